@@ -11,11 +11,16 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <libHX/ctype_helper.h>
 #include <libHX/defs.h>
@@ -25,6 +30,33 @@
 #	error Sorry, we do not support CHAR_BIT > 8 yet.
 #endif
 
+/**
+ * @buf:	reusable output buffer of the quoting functions
+ * @size:	allocated size of @buf
+ * @prev:	last byte seen by btc_memquote, -1 if none
+ * @prev_quoted: whether @prev was emitted as an escape sequence
+ */
+struct btc_quotebuf {
+	char *buf;
+	size_t size;
+	int prev;
+	bool prev_quoted;
+};
+
+enum {
+	BTC_SLICE_SIZE = 1 << 20,
+};
+
+/**
+ * Ready-made output for one input byte. @s is not NUL-terminated, and is
+ * always copied in full (the quote buffer has slack for it), which is cheaper
+ * than a variable-length copy.
+ */
+struct btc_token {
+	char s[7];
+	unsigned char len;
+};
+
 /**
  * @cfp: 	file handle for output of the definition
  * 		(this can be the same as @hfile!)
@@ -34,13 +66,57 @@
  * @ifile:	input file name (as on the command line)
  * @ifile_path:	real file path (after possibly prepending @btc_prefix_directory)
  * @isize:	size of the input file in bytes
+ * @quote:	output buffer for the quoting functions
+ * @alias:	earlier input file with the same contents (for --dedup)
+ * @alias_vname: variable name for @alias
+ * @map:	mapping of the input file, if it could be mapped
+ * @map_pos:	offset of the next slice in @map
+ * @map_prev:	offset of the slice handed out last
+ * @map_prevlen: length of that slice (0 if none)
+ * @rdbuf:	buffer for btc_read_slice when the input is not mapped
  */
 struct btc_state {
 	FILE *cfp, *hfp;
-	hxmc_t *vname;
+	hxmc_t *vname, *alias_vname;
 	FILE *ifp;
 	const char *ifile, *ifile_path, *guard_name;
 	size_t isize;
+	struct btc_quotebuf quote;
+	const char *alias;
+	const unsigned char *map;
+	size_t map_pos, map_prev, map_prevlen;
+	char *rdbuf;
+};
+
+/**
+ * @ifile:	input file name (as on the command line)
+ * @alias:	earlier input file with the same contents, if any
+ * @cbuf:	output for the .c file (or the only file)
+ * @hbuf:	output for the .h file, if separate
+ * @ret:	result of btc_process_single_pf
+ * @done:	@cbuf/@hbuf are complete and may be written out
+ */
+struct btc_job {
+	const char *ifile, *alias;
+	char *cbuf, *hbuf;
+	size_t csize, hsize;
+	int ret;
+	bool done;
+};
+
+/**
+ * @job:	one job per input file, in argv order
+ * @next:	index of the next job to hand out
+ * @wanted:	index of the job the writer is waiting for
+ * @split:	whether .c and .h output go to different files
+ * @abort:	stop handing out jobs
+ */
+struct btc_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct btc_job *job;
+	size_t njobs, next, wanted;
+	bool split, abort;
 };
 
 struct btc_operations {
@@ -48,6 +124,7 @@ struct btc_operations {
 	void (*global_footer)(struct btc_state *);
 	void (*file_predecl)(struct btc_state *);
 	void (*file_content)(struct btc_state *);
+	void (*file_alias)(struct btc_state *);
 	void (*func_header)(struct btc_state *);
 };
 
@@ -55,42 +132,138 @@ static hxmc_t *btc_cfile, *btc_hfile;
 static hxmc_t *btc_guard_name;
 static char *btc_prefix_directory;
 static unsigned int btc_verbose, btc_emit_wxbitmap, btc_emit_ultra;
+static unsigned int btc_jobs, btc_update, btc_dedup;
+static unsigned int btc_emit_incbin, btc_emit_embed, btc_emit_wide;
+static unsigned int btc_emit_compress, btc_align, btc_toc;
+static char *btc_section;
+/* attribute lists for data definitions, and for the .bss buffers */
+static char btc_attr_data[256], btc_attr_bss[64];
+static char *btc_endian;
+static bool btc_big_endian;
 static const struct btc_operations *btc_ops;
 static int btc_strip = -1;
+static size_t btc_pagesize;
 
-static char *btc_tblquote(const void *vsrc, size_t input_size)
+/*
+ * btc_tbl_token: array element syntax, e.g. '0', or 0177, (for btc_tblquote)
+ * btc_str_token: string literal syntax (for btc_memquote); a token of length
+ * 1 denotes a byte that needs no escaping. btc_str_full has the 3-digit octal
+ * form to be used when a digit follows.
+ */
+static struct btc_token btc_tbl_token[256], btc_str_token[256], btc_str_full[256];
+static const struct btc_token btc_str_trigraph = {"\\077", 4};
+
+static void btc_set_token(struct btc_token *t, const char *fmt, unsigned int c)
 {
-	const unsigned char *src = vsrc;
-	size_t quoted_size = input_size * 5;
-	char *out, *p;
+	t->len = snprintf(t->s, sizeof(t->s), fmt, c);
+}
 
-	p = out = malloc(quoted_size + 1);
-	if (out == NULL)
-		abort();
-	for (; input_size-- > 0; ++src) {
-		if (*src == 0) {
-			*p++ = '0';
-		} else if (*src <= 07) {
-			*p++ = '0';
-			*p++ = '0' + (*src & 0007);
-		} else if (HX_isprint(*src) && *src != '\'' && *src != '\\') {
-			*p++ = '\'';
-			*p++ = *src;
-			*p++ = '\'';
-		} else if (*src <= 077) {
-			*p++ = '0';
-			*p++ = '0' + ((*src & 0070) >> 3);
-			*p++ = '0' + (*src & 0007);
+static void btc_init_tables(void)
+{
+	unsigned int c;
+
+	for (c = 0; c < 256; ++c) {
+		if (c == 0)
+			btc_set_token(&btc_tbl_token[c], "0,", c);
+		else if (HX_isprint(c) && c != '\'' && c != '\\')
+			btc_set_token(&btc_tbl_token[c], "'%c',", c);
+		else
+			btc_set_token(&btc_tbl_token[c], "0%o,", c);
+
+		if (c == '\"' || c == '\\') {
+			btc_set_token(&btc_str_token[c], "\\%c", c);
+			btc_str_full[c] = btc_str_token[c];
+		} else if (HX_isprint(c)) {
+			btc_set_token(&btc_str_token[c], "%c", c);
+			btc_str_full[c] = btc_str_token[c];
 		} else {
-			*p++ = '0';
-			*p++ = '0' + ((*src & 0700) >> 6);
-			*p++ = '0' + ((*src & 0070) >> 3);
-			*p++ = '0' + (*src & 0007);
+			btc_set_token(&btc_str_token[c], c > 0070 ? "\\%03o" :
+			              c > 0007 ? "\\%02o" : "\\%o", c);
+			btc_set_token(&btc_str_full[c], "\\%03o", c);
 		}
-		*p++ = ',';
+	}
+}
+
+/**
+ * Make room for @z bytes of output (plus the slack needed by token copies).
+ */
+static char *btc_quote_reserve(struct btc_quotebuf *q, size_t z)
+{
+	z += sizeof(((struct btc_token *)NULL)->s) + 1;
+	if (z <= q->size)
+		return q->buf;
+	free(q->buf);
+	q->buf = malloc(z);
+	if (q->buf == NULL)
+		abort();
+	q->size = z;
+	return q->buf;
+}
+
+static void btc_quote_reset(struct btc_quotebuf *q)
+{
+	q->prev = -1;
+	q->prev_quoted = false;
+}
+
+/**
+ * Hand out the next slice of the input file: straight from the mapping if
+ * there is one (and drop the previous slice from it, so that huge files do not
+ * pile up in our RSS), or else read into @state->rdbuf. Slices are
+ * BTC_SLICE_SIZE bytes except for the last one, which btc_widequote relies
+ * on. Returns the length, 0 at the end.
+ */
+static size_t btc_read_slice(struct btc_state *state, const void **out)
+{
+	size_t len, start, end;
+
+	if (state->map != NULL) {
+		/*
+		 * The mapping is page-aligned, so rounding the start down stays
+		 * within it; the end is a slice boundary (a page multiple) or
+		 * @isize, whose partial last page is still ours.
+		 */
+		if (state->map_prevlen > 0) {
+			start = state->map_prev & ~(btc_pagesize - 1);
+			end   = state->map_prev + state->map_prevlen;
+			madvise(static_cast(void *, state->map + start),
+			        end - start, MADV_DONTNEED);
+		}
+		len = state->isize - state->map_pos;
+		if (len > BTC_SLICE_SIZE)
+			len = BTC_SLICE_SIZE;
+		*out = state->map + state->map_pos;
+		state->map_prev    = state->map_pos;
+		state->map_prevlen = len;
+		state->map_pos += len;
+		return len;
+	}
+	if (state->rdbuf == NULL) {
+		state->rdbuf = malloc(BTC_SLICE_SIZE);
+		if (state->rdbuf == NULL)
+			abort();
+	}
+	*out = state->rdbuf;
+	return fread(state->rdbuf, 1, BTC_SLICE_SIZE, state->ifp);
+}
+
+/**
+ * Quote @input_size bytes into @q->buf as a comma-separated list of char
+ * literals. Returns the length of the output.
+ */
+static size_t btc_tblquote(struct btc_quotebuf *q, const void *vsrc,
+    size_t input_size)
+{
+	const unsigned char *src = vsrc, *end = src + input_size;
+	char *out = btc_quote_reserve(q, input_size * 5), *p = out;
+
+	for (; src < end; ++src) {
+		const struct btc_token *t = &btc_tbl_token[*src];
+		memcpy(p, t->s, sizeof(t->s));
+		p += t->len;
 	}
 	*p = '\0';
-	return out;
+	return p - out;
 }
 
 /*
@@ -105,47 +278,93 @@ static char *btc_tblquote(const void *vsrc, size_t input_size)
  * 3F:!3F			1/256*255/256	1 (?)
  * 7F..FF			129/256		4 (\177 .. \377)
  * average bytes per byte around 2.74411 (the 3F cases are hard to determine)
+ *
+ * Successive calls continue the same string literal; the trigraph state is
+ * carried over in @q. Returns the length of the output.
  */
-static char *btc_memquote(const void *vsrc, size_t input_size)
+static size_t btc_memquote(struct btc_quotebuf *q, const void *vsrc,
+    size_t input_size)
 {
-	size_t quoted_size = input_size * 4 + 1;
-	char *out, *p;
-	const unsigned char *src = vsrc;
-	bool qthis, qnext;
-
-	p = out = malloc(quoted_size + 1);
-	qnext = input_size > 1 && (src[0] == '\"' || src[0] == '\\' || !HX_isprint(src[0]));
-	for (; input_size-- > 0; ++src) {
-		qthis = qnext;
-		qnext = input_size > 0 && (!HX_isprint(src[1]) ||
-		        src[1] == '\"' || src[1] == '\\' ||
-		        (src[1] == '?' && src[0] == '?' && !qthis));
-		if (!qthis) {
-			*p++ = *src;
-			continue;
-		}
-		bool full = input_size == 0 || (!qnext && HX_isdigit(src[1]));
-		*p++ = '\\';
-		if (*src == '\"' || *src == '\\') {
-			*p++ = *src;
-			continue;
-		}
-		if (full || *src > 0070)
-			*p++ = '0' + ((*src & 0700) >> 6);
-		if (full || *src > 0007)
-			*p++ = '0' + ((*src & 0070) >> 3);
-		*p++ = '0' + (*src & 0007);
+	const unsigned char *src = vsrc, *end = src + input_size;
+	char *out = btc_quote_reserve(q, input_size * 4), *p = out;
+
+	for (; src < end; ++src) {
+		const struct btc_token *t = &btc_str_token[*src];
+		if (t->len == 1 && *src == '?' && q->prev == '?' && !q->prev_quoted)
+			t = &btc_str_trigraph;
+		else if (t->len > 1 && t->s[0] == '\\' && (src + 1 == end ||
+		    HX_isdigit(src[1])))
+			/* The last byte of a chunk does not know its successor. */
+			t = &btc_str_full[*src];
+		memcpy(p, t->s, sizeof(t->s));
+		p += t->len;
+		q->prev = *src;
+		q->prev_quoted = t->len > 1;
 	}
 	*p = '\0';
-	return out;
+	return p - out;
+}
+
+/**
+ * Pack @input_size bytes into words of btc_emit_wide bits and output them as
+ * a comma-separated list of hex literals, without leading zeros. The last
+ * word is padded with zero bytes. Returns the length of the output.
+ */
+static size_t btc_widequote(struct btc_quotebuf *q, const void *vsrc,
+    size_t input_size)
+{
+	static const char hexdigit[] = "0123456789abcdef";
+	const unsigned char *src = vsrc, *end = src + input_size;
+	unsigned int wb = btc_emit_wide / CHAR_BIT;
+	char *out = btc_quote_reserve(q, (input_size + wb - 1) / wb *
+	            (2 * wb + 3)), *p = out;
+
+	for (; src < end; src += wb) {
+		unsigned int i, n = end - src < wb ? end - src : wb;
+		uint64_t v = 0;
+		int shift;
+
+		for (i = 0; i < n; ++i)
+			v |= (uint64_t)src[i] << (CHAR_BIT *
+			     (btc_big_endian ? wb - 1 - i : i));
+		*p++ = '0';
+		*p++ = 'x';
+		for (shift = btc_emit_wide - 4; shift > 0 && (v >> shift) == 0;
+		     shift -= 4)
+			;
+		for (; shift >= 0; shift -= 4)
+			*p++ = hexdigit[(v >> shift) & 0xF];
+		*p++ = ',';
+	}
+	*p = '\0';
+	return p - out;
 }
 
 static char *btc_strquote(const char *src)
 {
-	return btc_memquote(src, strlen(src));
+	struct btc_quotebuf q = {};
+
+	btc_quote_reset(&q);
+	btc_memquote(&q, src, strlen(src));
+	return q.buf;
 }
 
-static void btc_generic_global_header(struct btc_state *state)
+/**
+ * Start the .c file of a .c/.h pair by including the header.
+ */
+static void btc_c_preamble(struct btc_state *state)
+{
+	char *result;
+
+	if (state->cfp == state->hfp)
+		return;
+	fprintf(state->cfp, "/* Autogenerated by hxtools bin2c */\n");
+	result = btc_strquote(btc_hfile);
+	fprintf(state->cfp, "#include \"%s\"\n", result);
+	free(result);
+}
+
+static void btc_generic_h_header(struct btc_state *state)
 {
 	fprintf(state->hfp, "/* Autogenerated by hxtools bin2c */\n");
 	if (state->guard_name)
@@ -154,6 +373,12 @@ static void btc_generic_global_header(struct btc_state *state)
 	fprintf(state->hfp, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
 }
 
+static void btc_generic_global_header(struct btc_state *state)
+{
+	btc_c_preamble(state);
+	btc_generic_h_header(state);
+}
+
 static void btc_generic_global_footer(struct btc_state *state)
 {
 	fprintf(state->hfp, "\n#ifdef __cplusplus\n} /* extern \"C\" */\n#endif\n");
@@ -161,34 +386,40 @@ static void btc_generic_global_footer(struct btc_state *state)
 		fprintf(state->hfp, "\n\n#endif /* %s */\n", state->guard_name);
 }
 
+/**
+ * Make the variable for a duplicate input refer to the earlier one.
+ */
+static void btc_generic_file_alias(struct btc_state *state)
+{
+	fprintf(state->hfp, "/* %s has the same contents as %s */\n",
+	        state->ifile, state->alias);
+	fprintf(state->hfp, "#define bin2c_%s bin2c_%s\n",
+	        state->vname, state->alias_vname);
+}
+
 /**
  * Output the binary stream in a "normal" fashion.
  */
 static void btc_stdc_file_content(struct btc_state *state)
 {
-	char input_buf[4096], *output_buf;
-	size_t input_len;
+	const void *input;
+	size_t input_len, output_len;
 
 	fprintf(state->cfp, "/* Autogenerated from %s */\n", state->ifile);
 	if (state->cfp != state->hfp) {
 		fprintf(state->hfp, "extern const unsigned char bin2c_%s[%" HX_SIZET_FMT "u];\n",
 		        state->vname, state->isize);
-		fprintf(state->cfp, "const unsigned char bin2c_%s[%" HX_SIZET_FMT "u] = {",
-		        state->vname, state->isize);
+		fprintf(state->cfp, "const unsigned char bin2c_%s[%" HX_SIZET_FMT "u]%s = {",
+		        state->vname, state->isize, btc_attr_data);
 	} else {
 		fprintf(state->cfp,
-		        "static const unsigned char bin2c_%s[%" HX_SIZET_FMT "u] = {",
-		        state->vname, state->isize);
+		        "static const unsigned char bin2c_%s[%" HX_SIZET_FMT "u]%s = {",
+		        state->vname, state->isize, btc_attr_data);
 	}
 
-	while ((input_len = fread(input_buf, 1, sizeof(input_buf),
-	    state->ifp)) > 0)
-	{
-		output_buf = btc_tblquote(input_buf, input_len);
-		if (output_buf == NULL)
-			abort();
-		fwrite(output_buf, strlen(output_buf), 1, state->cfp);
-		free(output_buf);
+	while ((input_len = btc_read_slice(state, &input)) > 0) {
+		output_len = btc_tblquote(&state->quote, input, input_len);
+		fwrite(state->quote.buf, output_len, 1, state->cfp);
 	}
 	fprintf(state->cfp, "};\n");
 }
@@ -197,6 +428,336 @@ static const struct btc_operations btc_stdc_ops = {
 	.global_header = btc_generic_global_header,
 	.global_footer = btc_generic_global_footer,
 	.file_content  = btc_stdc_file_content,
+	.file_alias    = btc_generic_file_alias,
+};
+
+/**
+ * Output the binary stream as an array of 32- or 64-bit words, which takes
+ * about half the space of btc_stdc_file_content, and is parsed much faster.
+ * The byte view of the data is provided through a union and a macro, so the
+ * usual bin2c_NAME array is still there, and is aligned for word access.
+ * The word contents depend on the byte order, which is fixed at generation
+ * time and checked when the output is compiled.
+ */
+static void btc_wide_global_header(struct btc_state *state)
+{
+	const char *order = btc_big_endian ? "BIG" : "LITTLE";
+
+	btc_c_preamble(state);
+	fprintf(state->hfp, "/* Autogenerated by hxtools bin2c */\n");
+	if (state->guard_name)
+		fprintf(state->hfp, "#ifndef %s\n#define %s 1\n\n",
+		        state->guard_name, state->guard_name);
+	fprintf(state->hfp, "#include <stdint.h>\n");
+	fprintf(state->hfp, "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_%s_ENDIAN__\n", order);
+	fprintf(state->hfp, "#\terror This file was generated for %s-endian targets; rerun bin2c with --endian.\n",
+	        btc_big_endian ? "big" : "little");
+	fprintf(state->hfp, "#endif\n\n");
+	fprintf(state->hfp, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+}
+
+static void btc_wide_file_content(struct btc_state *state)
+{
+	const void *input;
+	size_t input_len, output_len;
+	size_t words = (state->isize + btc_emit_wide / CHAR_BIT - 1) /
+	               (btc_emit_wide / CHAR_BIT);
+
+	fprintf(state->cfp, "/* Autogenerated from %s */\n", state->ifile);
+	if (state->cfp != state->hfp) {
+		fprintf(state->hfp, "extern const union bin2c_u_%s {\n"
+		        "\tuint%u_t w[%" HX_SIZET_FMT "u];\n"
+		        "\tunsigned char c[%" HX_SIZET_FMT "u];\n"
+		        "} bin2c_w_%s;\n",
+		        state->vname, btc_emit_wide, words, state->isize,
+		        state->vname);
+		fprintf(state->cfp, "const union bin2c_u_%s bin2c_w_%s%s = {{",
+		        state->vname, state->vname, btc_attr_data);
+	} else {
+		fprintf(state->cfp, "static const union {\n"
+		        "\tuint%u_t w[%" HX_SIZET_FMT "u];\n"
+		        "\tunsigned char c[%" HX_SIZET_FMT "u];\n"
+		        "} bin2c_w_%s%s = {{",
+		        btc_emit_wide, words, state->isize, state->vname,
+		        btc_attr_data);
+	}
+
+	while ((input_len = btc_read_slice(state, &input)) > 0) {
+		output_len = btc_widequote(&state->quote, input, input_len);
+		fwrite(state->quote.buf, output_len, 1, state->cfp);
+	}
+	fprintf(state->cfp, "}};\n");
+	fprintf(state->hfp, "#define bin2c_%s (bin2c_w_%s.c)\n",
+	        state->vname, state->vname);
+}
+
+static void btc_wide_file_alias(struct btc_state *state)
+{
+	btc_generic_file_alias(state);
+	fprintf(state->hfp, "#define bin2c_w_%s bin2c_w_%s\n",
+	        state->vname, state->alias_vname);
+}
+
+static const struct btc_operations btc_wide_ops = {
+	.global_header = btc_wide_global_header,
+	.global_footer = btc_generic_global_footer,
+	.file_content  = btc_wide_file_content,
+	.file_alias    = btc_wide_file_alias,
+};
+
+/*
+ * LZ compression in the LZ4 block format: a sequence is a token byte
+ * (literal length in the high nibble, match length minus 4 in the low
+ * nibble; 15 means more length bytes follow, each adding up to 255), the
+ * literals, and a 16-bit little-endian match offset. The last sequence has
+ * only literals. Like LZ4, no match starts in the last 12 bytes, and the last
+ * 5 bytes are always literals.
+ */
+enum {
+	BTC_LZ_MINMATCH = 4,
+	BTC_LZ_HASHLOG = 16,
+	BTC_LZ_DEPTH = 256,
+	BTC_LZ_MAXOFF = 65535,
+};
+
+static const char btc_unlz_source[] =
+	"static void bin2c_unlz(unsigned char *dst, const unsigned char *src,\n"
+	"    const unsigned char *end)\n"
+	"{\n"
+	"\twhile (src < end) {\n"
+	"\t\tunsigned int token = *src++, b;\n"
+	"\t\tunsigned long len = token >> 4, off;\n"
+	"\t\tif (len == 15)\n"
+	"\t\t\tdo len += b = *src++; while (b == 255);\n"
+	"\t\tfor (; len > 0; --len)\n"
+	"\t\t\t*dst++ = *src++;\n"
+	"\t\tif (src >= end)\n"
+	"\t\t\tbreak;\n"
+	"\t\toff = src[0] | (src[1] << 8);\n"
+	"\t\tsrc += 2;\n"
+	"\t\tlen = (token & 15) + 4;\n"
+	"\t\tif ((token & 15) == 15)\n"
+	"\t\t\tdo len += b = *src++; while (b == 255);\n"
+	"\t\tfor (; len > 0; --len, ++dst)\n"
+	"\t\t\t*dst = *(dst - off);\n"
+	"\t}\n"
+	"}\n";
+
+static unsigned char *btc_lz_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *btc_lz_sequence(unsigned char *op,
+    const unsigned char *lit, size_t litlen, size_t off, size_t mlen)
+{
+	unsigned char *token = op++;
+
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if (litlen >= 15)
+		op = btc_lz_length(op, litlen - 15);
+	memcpy(op, lit, litlen);
+	op += litlen;
+	if (mlen == 0)
+		return op;
+	*op++ = off;
+	*op++ = off >> 8;
+	mlen -= BTC_LZ_MINMATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if (mlen >= 15)
+		op = btc_lz_length(op, mlen - 15);
+	return op;
+}
+
+static inline uint32_t btc_lz_read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * Match finder: @head has the most recent position (plus one) for each hash
+ * of 4 bytes, and @chain links each position in the window to the previous
+ * one with the same hash.
+ */
+struct btc_lz {
+	const unsigned char *src, *matchlimit;
+	uint32_t head[1 << BTC_LZ_HASHLOG];
+	uint32_t chain[BTC_LZ_MAXOFF + 1];
+};
+
+static inline uint32_t btc_lz_hash(const unsigned char *p)
+{
+	return (btc_lz_read32(p) * UINT32_C(2654435761)) >> (32 - BTC_LZ_HASHLOG);
+}
+
+static inline void btc_lz_insert(struct btc_lz *lz, const unsigned char *p)
+{
+	uint32_t h = btc_lz_hash(p), pos = p - lz->src;
+
+	lz->chain[pos & BTC_LZ_MAXOFF] = lz->head[h];
+	lz->head[h] = pos + 1;
+}
+
+/**
+ * Find the longest match for @ip among the last BTC_LZ_DEPTH candidates.
+ * Returns its length (0 if none), and the distance in @off.
+ */
+static size_t btc_lz_match(const struct btc_lz *lz, const unsigned char *ip,
+    size_t *off)
+{
+	uint32_t cand = lz->head[btc_lz_hash(ip)];
+	unsigned int depth = BTC_LZ_DEPTH;
+	size_t best = BTC_LZ_MINMATCH - 1, len;
+
+	for (; cand != 0 && depth > 0; --depth,
+	     cand = lz->chain[(cand - 1) & BTC_LZ_MAXOFF]) {
+		const unsigned char *ref = lz->src + cand - 1;
+
+		if (ip - ref > BTC_LZ_MAXOFF)
+			break;
+		if (ref[best] != ip[best] ||
+		    btc_lz_read32(ref) != btc_lz_read32(ip))
+			continue;
+		for (len = BTC_LZ_MINMATCH; ip + len < lz->matchlimit &&
+		     ref[len] == ip[len]; ++len)
+			;
+		if (len > best) {
+			best = len;
+			*off = ip - ref;
+			if (ip + len >= lz->matchlimit)
+				break;
+		}
+	}
+	return best >= BTC_LZ_MINMATCH ? best : 0;
+}
+
+/**
+ * Compress @n bytes from @src into @dst, which must have room for
+ * btc_lz_bound(@n) bytes. Since this runs at build time, it searches hash
+ * chains and defers matches by one byte when that yields a longer one,
+ * which compresses a lot better than the greedy LZ4 compressor.
+ * Returns the compressed size.
+ */
+static size_t btc_lz_compress(const unsigned char *src, size_t n,
+    unsigned char *dst, struct btc_lz *lz)
+{
+	const unsigned char *ip = src, *anchor = src, *end = src + n;
+	const unsigned char *mflimit = n > 12 ? end - 12 : src;
+	unsigned char *op = dst;
+	size_t mlen, off = 0, mlen2, off2 = 0;
+
+	memset(lz->head, 0, sizeof(lz->head));
+	lz->src = src;
+	lz->matchlimit = n > 5 ? end - 5 : src;
+	while (ip < mflimit) {
+		mlen = btc_lz_match(lz, ip, &off);
+		btc_lz_insert(lz, ip);
+		if (mlen == 0) {
+			++ip;
+			continue;
+		}
+		while (ip + 1 < mflimit &&
+		    (mlen2 = btc_lz_match(lz, ip + 1, &off2)) > mlen) {
+			++ip;
+			btc_lz_insert(lz, ip);
+			mlen = mlen2;
+			off = off2;
+		}
+		op = btc_lz_sequence(op, anchor, ip - anchor, off, mlen);
+		for (anchor = ip + mlen; ++ip < anchor && ip < mflimit; )
+			btc_lz_insert(lz, ip);
+		ip = anchor;
+	}
+	return btc_lz_sequence(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+static inline size_t btc_lz_bound(size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+/**
+ * Output the binary stream compressed, together with a decompressor and an
+ * accessor function which decompresses into a static buffer on first use.
+ * The decompressed buffer lives in .bss, so it takes no space in the file.
+ */
+static void btc_compress_global_header(struct btc_state *state)
+{
+	btc_generic_global_header(state);
+	fprintf(state->cfp, "%s", btc_unlz_source);
+}
+
+static void btc_compress_file_content(struct btc_state *state)
+{
+	const unsigned char *data = state->map;
+	unsigned char *raw = NULL, *lz;
+	struct btc_lz *table;
+	size_t raw_len = state->isize, lz_len, output_len;
+	const char *scope = state->cfp != state->hfp ? "" : "static ";
+
+	if (data == NULL) {
+		raw = malloc(state->isize + 1);
+		if (raw == NULL)
+			abort();
+		raw_len = fread(raw, 1, state->isize, state->ifp);
+		data = raw;
+	}
+	lz = malloc(btc_lz_bound(raw_len));
+	table = malloc(sizeof(*table));
+	if (lz == NULL || table == NULL)
+		abort();
+	lz_len = btc_lz_compress(data, raw_len, lz, table);
+	if (btc_verbose)
+		printf("%s: %" HX_SIZET_FMT "u -> %" HX_SIZET_FMT "u bytes\n",
+		       state->ifile, raw_len, lz_len);
+
+	fprintf(state->cfp, "/* Autogenerated from %s */\n", state->ifile);
+	fprintf(state->hfp, "#define bin2c_size_%s %" HX_SIZET_FMT "u\n",
+	        state->vname, raw_len);
+	if (state->cfp != state->hfp)
+		fprintf(state->hfp, "extern const unsigned char *bin2c_get_%s(void);\n",
+		        state->vname);
+	fprintf(state->cfp, "static const unsigned char bin2c_z_%s[%" HX_SIZET_FMT "u]%s = {",
+	        state->vname, lz_len, btc_attr_data);
+	output_len = btc_tblquote(&state->quote, lz, lz_len);
+	fwrite(state->quote.buf, output_len, 1, state->cfp);
+	fprintf(state->cfp, "};\n");
+	fprintf(state->cfp, "static unsigned char bin2c_buf_%s[%" HX_SIZET_FMT "u]%s;\n",
+	        state->vname, raw_len, btc_attr_bss);
+	fprintf(state->cfp, "%sconst unsigned char *bin2c_get_%s(void)\n{\n"
+	        "\tstatic int done;\n"
+	        "\tif (!done) {\n"
+	        "\t\tbin2c_unlz(bin2c_buf_%s, bin2c_z_%s, bin2c_z_%s + sizeof(bin2c_z_%s));\n"
+	        "\t\tdone = 1;\n"
+	        "\t}\n"
+	        "\treturn bin2c_buf_%s;\n}\n",
+	        scope, state->vname, state->vname, state->vname, state->vname,
+	        state->vname, state->vname);
+	free(table);
+	free(lz);
+	free(raw);
+}
+
+static void btc_compress_file_alias(struct btc_state *state)
+{
+	fprintf(state->hfp, "/* %s has the same contents as %s */\n",
+	        state->ifile, state->alias);
+	fprintf(state->hfp, "#define bin2c_size_%s bin2c_size_%s\n",
+	        state->vname, state->alias_vname);
+	fprintf(state->hfp, "#define bin2c_get_%s bin2c_get_%s\n",
+	        state->vname, state->alias_vname);
+}
+
+static const struct btc_operations btc_compress_ops = {
+	.global_header = btc_compress_global_header,
+	.global_footer = btc_generic_global_footer,
+	.file_content  = btc_compress_file_content,
+	.file_alias    = btc_compress_file_alias,
 };
 
 /**
@@ -212,30 +773,25 @@ static const struct btc_operations btc_stdc_ops = {
  */
 static void btc_ultra_file_content(struct btc_state *state)
 {
-	char input_buf[4096], *output_buf;
-	size_t input_len;
+	const void *input;
+	size_t input_len, output_len;
 
 	fprintf(state->cfp, "/* Autogenerated from %s */\n", state->ifile);
 
 	if (state->cfp != state->hfp) {
 		fprintf(state->hfp, "extern const unsigned char bin2c_%s[%" HX_SIZET_FMT "u];\n",
 		        state->vname, state->isize + 1);
-		fprintf(state->cfp, "const unsigned char bin2c_%s[%" HX_SIZET_FMT "u] = \"",
-		        state->vname, state->isize + 1);
+		fprintf(state->cfp, "const unsigned char bin2c_%s[%" HX_SIZET_FMT "u]%s = \"",
+		        state->vname, state->isize + 1, btc_attr_data);
 	} else {
 		fprintf(state->cfp,
-		        "static const unsigned char bin2c_%s[%" HX_SIZET_FMT "u] = \"",
-		        state->vname, state->isize + 1);
+		        "static const unsigned char bin2c_%s[%" HX_SIZET_FMT "u]%s = \"",
+		        state->vname, state->isize + 1, btc_attr_data);
 	}
 
-	while ((input_len = fread(input_buf, 1, sizeof(input_buf),
-	    state->ifp)) > 0)
-	{
-		output_buf = btc_memquote(input_buf, input_len);
-		if (output_buf == NULL)
-			abort();
-		fwrite(output_buf, strlen(output_buf), 1, state->cfp);
-		free(output_buf);
+	while ((input_len = btc_read_slice(state, &input)) > 0) {
+		output_len = btc_memquote(&state->quote, input, input_len);
+		fwrite(state->quote.buf, output_len, 1, state->cfp);
 	}
 	fprintf(state->cfp, "\";\n");
 }
@@ -244,10 +800,93 @@ static const struct btc_operations btc_ultra_ops = {
 	.global_header = btc_generic_global_header,
 	.global_footer = btc_generic_global_footer,
 	.file_content  = btc_ultra_file_content,
+	.file_alias    = btc_generic_file_alias,
+};
+
+/**
+ * Output an assembler file that pulls in the data with .incbin, so that the
+ * compiler never gets to see the contents. Requires a .S/.h pair.
+ */
+static void btc_incbin_global_header(struct btc_state *state)
+{
+	fprintf(state->cfp, "/* Autogenerated by hxtools bin2c */\n");
+	btc_generic_h_header(state);
+}
+
+static void btc_incbin_global_footer(struct btc_state *state)
+{
+	btc_generic_global_footer(state);
+	fprintf(state->cfp, "\t.section .note.GNU-stack,\"\",%%progbits\n");
+}
+
+static void btc_incbin_file_content(struct btc_state *state)
+{
+	char *path = btc_strquote(state->ifile_path);
+
+	fprintf(state->hfp, "extern const unsigned char bin2c_%s[%" HX_SIZET_FMT "u];\n",
+	        state->vname, state->isize);
+	fprintf(state->cfp, "/* Autogenerated from %s */\n", state->ifile);
+	if (btc_section != NULL)
+		fprintf(state->cfp, "\t.section %s,\"a\"\n", btc_section);
+	else
+		fprintf(state->cfp, "\t.section .rodata\n");
+	if (btc_align != 0)
+		fprintf(state->cfp, "\t.balign %u\n", btc_align);
+	fprintf(state->cfp, "\t.global bin2c_%s\n", state->vname);
+	fprintf(state->cfp, "\t.type bin2c_%s, %%object\n", state->vname);
+	fprintf(state->cfp, "bin2c_%s:\n", state->vname);
+	fprintf(state->cfp, "\t.incbin \"%s\"\n", path);
+	fprintf(state->cfp, ".Lbin2c_%s_end:\n", state->vname);
+	fprintf(state->cfp, "\t.if .Lbin2c_%s_end - bin2c_%s != %" HX_SIZET_FMT "u\n",
+	        state->vname, state->vname, state->isize);
+	fprintf(state->cfp, "\t.error \"%s changed size since bin2c was run\"\n", path);
+	fprintf(state->cfp, "\t.endif\n");
+	fprintf(state->cfp, "\t.size bin2c_%s, .Lbin2c_%s_end - bin2c_%s\n",
+	        state->vname, state->vname, state->vname);
+	free(path);
+}
+
+static const struct btc_operations btc_incbin_ops = {
+	.global_header = btc_incbin_global_header,
+	.global_footer = btc_incbin_global_footer,
+	.file_content  = btc_incbin_file_content,
+	.file_alias    = btc_generic_file_alias,
+};
+
+/**
+ * Output the data as a C23 #embed directive. The path is quoted like for
+ * #include; note that the preprocessor resolves it relative to the .c file's
+ * directory (and then the include path), not the current directory.
+ */
+static void btc_embed_file_content(struct btc_state *state)
+{
+	char *path = btc_strquote(state->ifile_path);
+
+	fprintf(state->cfp, "/* Autogenerated from %s */\n", state->ifile);
+	if (state->cfp != state->hfp) {
+		fprintf(state->hfp, "extern const unsigned char bin2c_%s[%" HX_SIZET_FMT "u];\n",
+		        state->vname, state->isize);
+		fprintf(state->cfp, "const unsigned char bin2c_%s[%" HX_SIZET_FMT "u]%s = {\n",
+		        state->vname, state->isize, btc_attr_data);
+	} else {
+		fprintf(state->cfp,
+		        "static const unsigned char bin2c_%s[%" HX_SIZET_FMT "u]%s = {\n",
+		        state->vname, state->isize, btc_attr_data);
+	}
+	fprintf(state->cfp, "#embed \"%s\"\n};\n", path);
+	free(path);
+}
+
+static const struct btc_operations btc_embed_ops = {
+	.global_header = btc_generic_global_header,
+	.global_footer = btc_generic_global_footer,
+	.file_content  = btc_embed_file_content,
+	.file_alias    = btc_generic_file_alias,
 };
 
 static void btc_wxbitmap_global_header(struct btc_state *state)
 {
+	btc_c_preamble(state);
 	fprintf(state->hfp, "/* Autogenerated by hxtools bin2c */\n");
 	if (state->guard_name != NULL)
 		fprintf(state->hfp, "#ifndef %s\n#define %s 1\n\n",
@@ -284,18 +923,13 @@ static void btc_wxbitmap_func_header(struct btc_state *state)
 
 static void btc_wxbitmap_file_content(struct btc_state *state)
 {
-	char input_buf[4096], *output_buf;
-	size_t input_len;
+	const void *input;
+	size_t input_len, output_len;
 
 	fprintf(state->cfp, "\t{\n\t\twxMemoryInputStream sm(\"");
-	while ((input_len = fread(input_buf, 1, sizeof(input_buf),
-	    state->ifp)) > 0)
-	{
-		output_buf = btc_memquote(input_buf, input_len);
-		if (output_buf == NULL)
-			abort();
-		fwrite(output_buf, strlen(output_buf), 1, state->cfp);
-		free(output_buf);
+	while ((input_len = btc_read_slice(state, &input)) > 0) {
+		output_len = btc_memquote(&state->quote, input, input_len);
+		fwrite(state->quote.buf, output_len, 1, state->cfp);
 	}
 	fprintf(state->cfp, "\", %" HX_SIZET_FMT "u);\n\t\tbin2c_%s = new wxBitmap(wxImage(sm, wxBITMAP_TYPE_ANY), -1);\n\t}\n",
 	        state->isize, state->vname);
@@ -362,7 +996,19 @@ static hxmc_t *btc_construct_vname(const char *cfile)
  */
 static int btc_process_single(struct btc_state *state)
 {
+	struct timespec start, stop;
 	struct stat sb;
+	double secs;
+	void *map;
+
+	if (state->alias != NULL) {
+		state->vname = btc_construct_vname(state->ifile);
+		state->alias_vname = btc_construct_vname(state->alias);
+		btc_ops->file_alias(state);
+		HXmc_free(state->vname);
+		HXmc_free(state->alias_vname);
+		return 0;
+	}
 
 	if (stat(state->ifile_path, &sb) != 0) {
 		fprintf(stderr, "ERROR: Cannot stat %s: %s\n",
@@ -378,7 +1024,31 @@ static int btc_process_single(struct btc_state *state)
 	}
 	state->isize = sb.st_size;
 	state->vname = btc_construct_vname(state->ifile);
+	state->map = NULL;
+	state->map_pos = state->map_prev = state->map_prevlen = 0;
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	    static_cast(uint64_t, sb.st_size) <= SIZE_MAX) {
+		map = mmap(NULL, state->isize, PROT_READ, MAP_SHARED,
+		      fileno(state->ifp), 0);
+		if (map != MAP_FAILED) {
+			madvise(map, state->isize, MADV_SEQUENTIAL);
+			state->map = map;
+		}
+	}
+	btc_quote_reset(&state->quote);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	btc_ops->file_content(state);
+	if (btc_verbose) {
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		secs = stop.tv_sec - start.tv_sec +
+		       (stop.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%s: %" HX_SIZET_FMT "u bytes in %.3f s (%.1f MB/s)\n",
+		        state->ifile, state->isize, secs,
+		        secs > 0 ? state->isize / secs / 1e6 : 0);
+	}
+	if (state->map != NULL)
+		munmap(static_cast(void *, state->map), state->isize);
+	state->map = NULL;
 	HXmc_free(state->vname);
 	fclose(state->ifp);
 	return 0;
@@ -405,38 +1075,539 @@ static int btc_process_single_pf(struct btc_state *state)
 	return ret;
 }
 
+/**
+ * Worker thread for -j: quote files into in-memory streams until the pool
+ * runs dry. Workers stay within 2*btc_jobs files of the writer, so that one
+ * slow file does not make the output of all later ones pile up in memory.
+ */
+static void *btc_worker(void *arg)
+{
+	struct btc_pool *pool = arg;
+	struct btc_state state = {};
+	struct btc_job *job;
+
+	state.guard_name = btc_guard_name;
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->abort && pool->next < pool->njobs &&
+		    pool->next >= pool->wanted + 2 * btc_jobs)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->abort || pool->next == pool->njobs) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->job[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		state.ifile = job->ifile;
+		state.alias = job->alias;
+		state.cfp = open_memstream(&job->cbuf, &job->csize);
+		state.hfp = !pool->split ? state.cfp :
+		            open_memstream(&job->hbuf, &job->hsize);
+		if (state.cfp == NULL || state.hfp == NULL)
+			job->ret = -errno;
+		else
+			job->ret = btc_process_single_pf(&state);
+		if (state.hfp != NULL && state.hfp != state.cfp)
+			fclose(state.hfp);
+		if (state.cfp != NULL)
+			fclose(state.cfp);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	free(state.quote.buf);
+	free(state.rdbuf);
+	return NULL;
+}
+
+/**
+ * Process all files given in @argv with btc_jobs threads, and write their
+ * output in argv order as soon as it becomes available, so that the result
+ * is the same as that of a serial run.
+ */
+static int btc_process_parallel(struct btc_state *state, const char **argv,
+    const char **alias)
+{
+	struct btc_pool pool = {.split = state->cfp != state->hfp};
+	unsigned int nthr = 0, i;
+	pthread_t *thr;
+	size_t n;
+	int ret = 0;
+
+	while (argv[pool.njobs] != NULL)
+		++pool.njobs;
+	if (pool.njobs == 0)
+		return 0;
+	pool.job = calloc(pool.njobs, sizeof(*pool.job));
+	thr = calloc(btc_jobs, sizeof(*thr));
+	if (pool.job == NULL || thr == NULL) {
+		ret = -errno;
+		goto out;
+	}
+	for (n = 0; n < pool.njobs; ++n) {
+		pool.job[n].ifile = argv[n];
+		pool.job[n].alias = alias != NULL ? alias[n] : NULL;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	for (; nthr < btc_jobs && nthr < pool.njobs; ++nthr) {
+		ret = pthread_create(&thr[nthr], NULL, btc_worker, &pool);
+		if (ret != 0) {
+			fprintf(stderr, "bin2c: ERROR: pthread_create: %s\n",
+			        strerror(ret));
+			ret = -ret;
+			break;
+		}
+	}
+
+	for (n = 0; ret == 0 && n < pool.njobs; ++n) {
+		struct btc_job *job = &pool.job[n];
+
+		pthread_mutex_lock(&pool.lock);
+		pool.wanted = n;
+		pthread_cond_broadcast(&pool.cond);
+		while (!job->done)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+		ret = job->ret;
+		if (ret != 0)
+			break;
+		fwrite(job->cbuf, job->csize, 1, state->cfp);
+		if (job->hbuf != NULL)
+			fwrite(job->hbuf, job->hsize, 1, state->hfp);
+		free(job->cbuf);
+		free(job->hbuf);
+		job->cbuf = job->hbuf = NULL;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.abort = true;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < nthr; ++i)
+		pthread_join(thr[i], NULL);
+	for (n = 0; n < pool.njobs; ++n) {
+		free(pool.job[n].cbuf);
+		free(pool.job[n].hbuf);
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+ out:
+	free(thr);
+	free(pool.job);
+	return ret;
+}
+
+/**
+ * Mix @len bytes into the digest @h, a word at a time. This only needs to
+ * detect changes, not withstand attacks.
+ */
+static void btc_hash_update(uint64_t *h, const void *vsrc, size_t len)
+{
+	const unsigned char *src = vsrc;
+	uint64_t w;
+
+	for (; len >= sizeof(w); src += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, src, sizeof(w));
+		*h = (((*h << 27) | (*h >> 37)) ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+	}
+	for (; len > 0; ++src, --len)
+		*h = (((*h << 27) | (*h >> 37)) ^ *src) * UINT64_C(0x100000001b3);
+}
+
+static void btc_hash_str(uint64_t *h, const char *s)
+{
+	if (s == NULL)
+		btc_hash_update(h, "\xff", 1);
+	else
+		btc_hash_update(h, s, strlen(s) + 1);
+}
+
+/**
+ * Open an input file, with btc_prefix_directory applied.
+ */
+static FILE *btc_open_input(const char *ifile)
+{
+	hxmc_t *path;
+	FILE *fp;
+
+	if (btc_prefix_directory == NULL)
+		return fopen(ifile, "r");
+	path = HXmc_strinit(btc_prefix_directory);
+	if (path == NULL || HXmc_strcat(&path, "/") == NULL ||
+	    HXmc_strcat(&path, ifile) == NULL) {
+		HXmc_free(path);
+		return NULL;
+	}
+	fp = fopen(path, "r");
+	HXmc_free(path);
+	return fp;
+}
+
+/**
+ * Mix the size and contents of @ifile into @h.
+ */
+static int btc_hash_file(uint64_t *h, const char *ifile)
+{
+	char input_buf[65536];
+	size_t input_len;
+	uint64_t size;
+	struct stat sb;
+	FILE *fp;
+
+	fp = btc_open_input(ifile);
+	if (fp == NULL)
+		return -errno;
+	if (fstat(fileno(fp), &sb) != 0) {
+		fclose(fp);
+		return -errno;
+	}
+	size = sb.st_size;
+	btc_hash_update(h, &size, sizeof(size));
+	while ((input_len = fread(input_buf, 1, sizeof(input_buf), fp)) > 0)
+		btc_hash_update(h, input_buf, input_len);
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * Compute the digest over everything that goes into the output: the
+ * options, and the names and contents of the input files.
+ */
+static int btc_digest(const char **argv, uint64_t *h)
+{
+	const int opts[] = {
+		2 /* output format revision */, btc_emit_wxbitmap,
+		btc_emit_ultra, btc_emit_incbin, btc_emit_embed,
+		btc_emit_wide, btc_big_endian, btc_strip, btc_dedup,
+		btc_emit_compress, btc_align, btc_toc,
+	};
+	int ret;
+
+	*h = UINT64_C(0xcbf29ce484222325);
+	btc_hash_update(h, opts, sizeof(opts));
+	btc_hash_str(h, btc_cfile);
+	btc_hash_str(h, btc_hfile);
+	btc_hash_str(h, btc_guard_name);
+	btc_hash_str(h, btc_prefix_directory);
+	btc_hash_str(h, btc_section);
+	for (; *argv != NULL; ++argv) {
+		btc_hash_str(h, *argv);
+		ret = btc_hash_file(h, *argv);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+struct btc_dupent {
+	uint64_t hash;
+	size_t idx;
+};
+
+static int btc_dupent_cmp(const void *va, const void *vb)
+{
+	const struct btc_dupent *a = va, *b = vb;
+
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return a->idx < b->idx ? -1 : a->idx > b->idx;
+}
+
+/**
+ * Returns 1 if the two files have the same contents, 0 if not, or a negative
+ * errno value.
+ */
+static int btc_same_content(const char *afile, const char *bfile)
+{
+	char abuf[65536], bbuf[65536];
+	size_t alen, blen;
+	FILE *afp, *bfp;
+	int ret = -1;
+
+	afp = btc_open_input(afile);
+	if (afp == NULL)
+		return -errno;
+	bfp = btc_open_input(bfile);
+	if (bfp == NULL) {
+		ret = -errno;
+		fclose(afp);
+		return ret;
+	}
+	while (ret < 0) {
+		alen = fread(abuf, 1, sizeof(abuf), afp);
+		blen = fread(bbuf, 1, sizeof(bbuf), bfp);
+		if (alen != blen || memcmp(abuf, bbuf, alen) != 0)
+			ret = 0;
+		else if (alen == 0)
+			ret = 1;
+	}
+	fclose(afp);
+	fclose(bfp);
+	return ret;
+}
+
+/**
+ * For --dedup: set @alias[i] to the first file in @argv which has the same
+ * contents as @argv[i], or NULL if there is none. Candidates are found by
+ * hash and then compared byte for byte.
+ */
+static int btc_find_duplicates(const char **argv, const char **alias)
+{
+	struct btc_dupent *ent;
+	size_t n = 0, i, j, k;
+	int ret = 0;
+
+	while (argv[n] != NULL)
+		++n;
+	if (n == 0)
+		return 0;
+	ent = calloc(n, sizeof(*ent));
+	if (ent == NULL)
+		return -errno;
+	for (i = 0; i < n; ++i) {
+		ent[i].idx = i;
+		ent[i].hash = UINT64_C(0xcbf29ce484222325);
+		ret = btc_hash_file(&ent[i].hash, argv[i]);
+		if (ret != 0) {
+			fprintf(stderr, "bin2c: ERROR: Could not read %s: %s\n",
+			        argv[i], strerror(-ret));
+			goto out;
+		}
+	}
+	qsort(ent, n, sizeof(*ent), btc_dupent_cmp);
+
+	/* Within a run of equal hashes, match each file to the earliest. */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && ent[j].hash == ent[i].hash; ++j)
+			;
+		for (k = i + 1; k < j; ++k) {
+			size_t m;
+
+			for (m = i; m < k; ++m) {
+				if (alias[ent[m].idx] != NULL)
+					continue;
+				ret = btc_same_content(argv[ent[m].idx],
+				      argv[ent[k].idx]);
+				if (ret < 0)
+					goto out;
+				if (ret > 0) {
+					alias[ent[k].idx] = argv[ent[m].idx];
+					break;
+				}
+			}
+		}
+	}
+	ret = 0;
+ out:
+	free(ent);
+	return ret;
+}
+
+/**
+ * Check whether the existing output files were generated from the same
+ * inputs, according to the digest on the first line of the header.
+ */
+static bool btc_up_to_date(uint64_t digest)
+{
+	char line[64], expect[64];
+	bool ret;
+	FILE *fp;
+
+	if (btc_cfile != NULL && access(btc_cfile, F_OK) != 0)
+		return false;
+	fp = fopen(btc_hfile, "r");
+	if (fp == NULL)
+		return false;
+	snprintf(expect, sizeof(expect), "/* bin2c digest: %016llx */\n",
+	         static_cast(unsigned long long, digest));
+	ret = fgets(line, sizeof(line), fp) != NULL &&
+	      strcmp(line, expect) == 0;
+	fclose(fp);
+	return ret;
+}
+
+/**
+ * Open an output file. With -u, a temporary file next to @name is created
+ * instead, and its name is returned in @tmpname, for btc_start to rename
+ * once everything has been written.
+ */
+static FILE *btc_open_output(const char *name, hxmc_t **tmpname)
+{
+	mode_t mask;
+	FILE *fp;
+	int fd;
+
+	if (!btc_update)
+		return fopen(name, "w");
+	*tmpname = HXmc_strinit(name);
+	if (*tmpname == NULL || HXmc_strcat(tmpname, ".XXXXXX") == NULL)
+		return NULL;
+	fd = mkstemp(*tmpname);
+	if (fd < 0)
+		return NULL;
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		int saved_errno = errno;
+		close(fd);
+		unlink(*tmpname);
+		errno = saved_errno;
+	}
+	return fp;
+}
+
+static uint32_t btc_toc_hash(const char *s)
+{
+	uint32_t h = UINT32_C(2166136261);
+
+	for (; *s != '\0'; ++s)
+		h = (h ^ static_cast(unsigned char, *s)) * UINT32_C(16777619);
+	return h;
+}
+
+/**
+ * Emit a table with the name (as on the command line), address and size of
+ * all files, and a function to look up entries by name in O(1) through an
+ * open-addressing hash table that is built right here. The symbols are
+ * suffixed with the guard name, so that multiple bin2c outputs can be linked
+ * together.
+ */
+static int btc_emit_toc(struct btc_state *state, const char **argv)
+{
+	const char *sfx = state->guard_name != NULL ? state->guard_name : "";
+	const char *sep = state->guard_name != NULL ? "_" : "";
+	const char *scope = state->cfp != state->hfp ? "" : "static ";
+	size_t n = 0, mask = 1, i, k;
+	unsigned int *idx;
+
+	while (argv[n] != NULL)
+		++n;
+	if (n == 0)
+		return 0;
+	while (mask < 2 * n)
+		mask <<= 1;
+	idx = calloc(mask--, sizeof(*idx));
+	if (idx == NULL)
+		return -errno;
+	for (i = 0; i < n; ++i) {
+		for (k = btc_toc_hash(argv[i]) & mask; idx[k] != 0;
+		     k = (k + 1) & mask)
+			;
+		idx[k] = i + 1;
+	}
+
+	fprintf(state->hfp, "\n#include <stddef.h>\n"
+	        "#ifndef BIN2C_TOC_ENTRY\n#define BIN2C_TOC_ENTRY 1\n"
+	        "struct bin2c_toc_entry {\n"
+	        "\tconst char *name;\n"
+	        "\tconst unsigned char *data;\n"
+	        "\tsize_t size;\n"
+	        "};\n#endif\n");
+	if (state->cfp != state->hfp)
+		fprintf(state->hfp, "extern const struct bin2c_toc_entry "
+		        "bin2c_toc%s%s[%" HX_SIZET_FMT "u];\n"
+		        "extern const struct bin2c_toc_entry *"
+		        "bin2c_toc_lookup%s%s(const char *);\n",
+		        sep, sfx, n, sep, sfx);
+
+	fprintf(state->cfp, "%sconst struct bin2c_toc_entry bin2c_toc%s%s[%" HX_SIZET_FMT "u] = {\n",
+	        scope, sep, sfx, n);
+	for (i = 0; i < n; ++i) {
+		char *name = btc_strquote(argv[i]);
+		hxmc_t *vname = btc_construct_vname(argv[i]);
+
+		fprintf(state->cfp, "\t{\"%s\", bin2c_%s, sizeof(bin2c_%s)%s},\n",
+		        name, vname, vname, btc_emit_ultra ? " - 1" : "");
+		HXmc_free(vname);
+		free(name);
+	}
+	fprintf(state->cfp, "};\n");
+	fprintf(state->cfp, "static const unsigned int bin2c_tocidx%s%s[%" HX_SIZET_FMT "u] = {",
+	        sep, sfx, mask + 1);
+	for (k = 0; k <= mask; ++k)
+		fprintf(state->cfp, "%u,", idx[k]);
+	fprintf(state->cfp, "};\n");
+	fprintf(state->cfp,
+	        "%sconst struct bin2c_toc_entry *bin2c_toc_lookup%s%s(const char *name)\n"
+	        "{\n"
+	        "\tunsigned long h = 2166136261U;\n"
+	        "\tconst unsigned char *p;\n"
+	        "\tunsigned int i;\n"
+	        "\tfor (p = (const unsigned char *)name; *p != '\\0'; ++p)\n"
+	        "\t\th = ((h ^ *p) * 16777619U) & 0xFFFFFFFFU;\n"
+	        "\tfor (i = h & %" HX_SIZET_FMT "u; bin2c_tocidx%s%s[i] != 0; i = (i + 1) & %" HX_SIZET_FMT "u) {\n"
+	        "\t\tconst struct bin2c_toc_entry *e = &bin2c_toc%s%s[bin2c_tocidx%s%s[i] - 1];\n"
+	        "\t\tconst char *a = e->name, *b = name;\n"
+	        "\t\twhile (*a == *b && *a != '\\0') {\n"
+	        "\t\t\t++a;\n"
+	        "\t\t\t++b;\n"
+	        "\t\t}\n"
+	        "\t\tif (*a == *b)\n"
+	        "\t\t\treturn e;\n"
+	        "\t}\n"
+	        "\treturn NULL;\n"
+	        "}\n",
+	        scope, sep, sfx, mask, sep, sfx, mask, sep, sfx, sep, sfx);
+	free(idx);
+	return 0;
+}
+
 /**
  * Process all files given in @argv.
  */
 static int btc_start(const char **argv)
 {
-	struct btc_state state;
-	const char **arg;
-	char *result;
+	struct btc_state state = {};
+	hxmc_t *ctmp = NULL, *htmp = NULL;
+	const char **arg, **alias = NULL;
+	uint64_t digest = 0;
 	int ret = 0;
 
-	state.hfp = fopen(btc_hfile, "w");
+	if (btc_update) {
+		/* Errors are reported by the regular run that follows. */
+		if (btc_digest(argv + 1, &digest) == 0 &&
+		    btc_up_to_date(digest)) {
+			if (btc_verbose)
+				printf("Output files are up to date\n");
+			return 0;
+		}
+	}
+
+	state.hfp = btc_open_output(btc_hfile, &htmp);
 	if (state.hfp == NULL) {
 		fprintf(stderr, "bin2c: ERROR: Could nt open %s for writing: "
 		        "%s\n", btc_hfile, strerror(errno));
-		return -errno;
+		ret = -errno;
+		HXmc_free(htmp);
+		return ret;
 	}
 
 	if (btc_cfile != NULL) {
-		state.cfp = fopen(btc_cfile, "w");
+		state.cfp = btc_open_output(btc_cfile, &ctmp);
 		if (state.cfp == NULL) {
 			fprintf(stderr, "bin2c: ERROR: Could not open %s for "
 			        "writing: %s\n", btc_cfile, strerror(errno));
-			return -errno;
+			ret = -errno;
+			fclose(state.hfp);
+			if (htmp != NULL)
+				unlink(htmp);
+			HXmc_free(htmp);
+			HXmc_free(ctmp);
+			return ret;
 		}
-		fprintf(state.cfp, "/* Autogenerated by hxtools bin2c */\n");
-		result = btc_strquote(btc_hfile);
-		fprintf(state.cfp, "#include \"%s\"\n", result);
-		free(result);
 	} else {
 		state.cfp = state.hfp;
 	}
 
+	if (btc_update)
+		fprintf(state.hfp, "/* bin2c digest: %016llx */\n",
+		        static_cast(unsigned long long, digest));
 	state.guard_name = btc_guard_name;
 	btc_ops->global_header(&state);
 
@@ -451,18 +1622,55 @@ static int btc_start(const char **argv)
 	if (btc_ops->func_header != NULL)
 		btc_ops->func_header(&state);
 
-	for (arg = argv + 1; *arg != NULL; ++arg) {
-		state.ifile = *arg;
-		ret = btc_process_single_pf(&state);
-		if (ret != 0)
-			break;
+	if (btc_dedup) {
+		for (arg = argv + 1; *arg != NULL; ++arg)
+			;
+		alias = calloc(arg - argv, sizeof(*alias));
+		ret = alias == NULL ? -errno :
+		      btc_find_duplicates(argv + 1, alias);
 	}
+	if (ret == 0 && btc_jobs > 1)
+		ret = btc_process_parallel(&state, argv + 1, alias);
+	else if (ret == 0)
+		for (arg = argv + 1; *arg != NULL; ++arg) {
+			state.ifile = *arg;
+			if (alias != NULL)
+				state.alias = alias[arg - argv - 1];
+			ret = btc_process_single_pf(&state);
+			if (ret != 0)
+				break;
+		}
+	free(alias);
+	if (ret == 0 && btc_toc)
+		ret = btc_emit_toc(&state, argv + 1);
 
 	btc_ops->global_footer(&state);
+	free(state.quote.buf);
+	free(state.rdbuf);
 	fclose(state.hfp);
 	if (state.cfp != state.hfp)
 		fclose(state.cfp);
-	if (ret != EXIT_SUCCESS) {
+	if (btc_update) {
+		/* Rename the header last, its digest vouches for the pair. */
+		if (ret == EXIT_SUCCESS && ctmp != NULL &&
+		    rename(ctmp, btc_cfile) != 0) {
+			ret = -errno;
+			fprintf(stderr, "bin2c: ERROR: Could not rename %s: "
+			        "%s\n", ctmp, strerror(errno));
+		}
+		if (ret == EXIT_SUCCESS && rename(htmp, btc_hfile) != 0) {
+			ret = -errno;
+			fprintf(stderr, "bin2c: ERROR: Could not rename %s: "
+			        "%s\n", htmp, strerror(errno));
+		}
+		if (ret != EXIT_SUCCESS) {
+			if (ctmp != NULL)
+				unlink(ctmp);
+			unlink(htmp);
+		}
+		HXmc_free(ctmp);
+		HXmc_free(htmp);
+	} else if (ret != EXIT_SUCCESS) {
 		if (btc_cfile != NULL)
 			unlink(btc_cfile);
 		if (btc_hfile != NULL)
@@ -472,6 +1680,8 @@ static int btc_start(const char **argv)
 }
 
 static const struct HXoption btc_option_table[] = {
+	{.ln = "align", .type = HXTYPE_UINT, .ptr = &btc_align,
+	 .help = "Align arrays to N bytes", .htyp = "N"},
 	{.sh = 'C', .type = HXTYPE_MCSTR, .ptr = &btc_cfile,
 	 .help = "Filename for the output .c file", .htyp = "FILE"},
 	{.sh = 'D', .type = HXTYPE_STRING, .ptr = &btc_prefix_directory,
@@ -480,12 +1690,33 @@ static const struct HXoption btc_option_table[] = {
 	 .help = "Name for the header's include guard"},
 	{.sh = 'H', .type = HXTYPE_MCSTR, .ptr = &btc_hfile,
 	 .help = "Filename for the output .h file", .htyp = "FILE"},
+	{.sh = 'j', .type = HXTYPE_UINT, .ptr = &btc_jobs,
+	 .help = "Process up to N files in parallel", .htyp = "N"},
 	{.sh = 'p', .type = HXTYPE_INT, .ptr = &btc_strip,
 	 .help = "Strip N path components (keep -N if N is negative)", .htyp = "N"},
+	{.sh = 'u', .ln = "update", .type = HXTYPE_NONE, .ptr = &btc_update,
+	 .help = "Leave output files alone if inputs and options are unchanged"},
 	{.sh = 'v', .type = HXTYPE_NONE, .ptr = &btc_verbose,
 	 .help = "Be verbose during operation"},
 	{.ln = "wxbitmap", .type = HXTYPE_NONE, .ptr = &btc_emit_wxbitmap,
 	 .help = "Generate wxBitmap variables rather than plain data"},
+	{.ln = "compress", .type = HXTYPE_NONE, .ptr = &btc_emit_compress,
+	 .help = "Generate compressed arrays plus a decompressor"},
+	{.ln = "dedup", .type = HXTYPE_NONE, .ptr = &btc_dedup,
+	 .help = "Emit files with identical contents only once"},
+	{.ln = "embed", .type = HXTYPE_NONE, .ptr = &btc_emit_embed,
+	 .help = "Generate C23 #embed directives rather than data"},
+	{.ln = "incbin", .type = HXTYPE_NONE, .ptr = &btc_emit_incbin,
+	 .help = "Generate an assembler file (-C) with .incbin directives"},
+	{.ln = "endian", .type = HXTYPE_STRING, .ptr = &btc_endian,
+	 .help = "Byte order of the target for --wide (default: host)",
+	 .htyp = "big|little"},
+	{.ln = "wide", .type = HXTYPE_UINT, .ptr = &btc_emit_wide,
+	 .help = "Generate arrays of 32- or 64-bit words", .htyp = "BITS"},
+	{.ln = "section", .type = HXTYPE_STRING, .ptr = &btc_section,
+	 .help = "Place arrays in the named section", .htyp = "NAME"},
+	{.ln = "toc", .type = HXTYPE_NONE, .ptr = &btc_toc,
+	 .help = "Generate a table of contents with a lookup function"},
 	{.ln = "ultra", .type = HXTYPE_NONE, .ptr = &btc_emit_ultra,
 	 .help = "Generate variables using +1-sized(!) string literals"},
 	HXOPT_AUTOHELP,
@@ -515,6 +1746,25 @@ static const char *btc_known_c_suffix(const char *s)
 	return NULL;
 }
 
+/**
+ * Detect any assembler/non-assembler file naming and either return the
+ * corresponding header file suffix, or report the suffix problem.
+ */
+static const char *btc_known_asm_suffix(const char *s)
+{
+	if (strcmp(s, ".S") == 0 || strcmp(s, ".sx") == 0)
+		return ".h";
+	if (strcmp(s, ".s") == 0)
+		fprintf(stderr, "bin2c: WARNING: The output needs to be run "
+		        "through the C preprocessor, so it should be named .S, "
+		        "not %s\n", s);
+	else
+		fprintf(stderr, "bin2c: WARNING: bin2c is set to output "
+		        "assembler code -- It is wrong to call the output "
+		        "file %s!\n", s);
+	return NULL;
+}
+
 /**
  * Detect any C++/non-C++ file naming and either return the corresponding
  * header file suffix, or report the suffix problem.
@@ -550,8 +1800,12 @@ static hxmc_t *btc_construct_hname(const char *cfile)
 	if (hfile == NULL)
 		return NULL;
 	suffix = strrchr(hfile, '.');
-	if (btc_emit_wxbitmap)
+	if (suffix == NULL)
+		repl = NULL;
+	else if (btc_emit_wxbitmap)
 		repl = btc_known_cpp_suffix(suffix);
+	else if (btc_emit_incbin)
+		repl = btc_known_asm_suffix(suffix);
 	else
 		repl = btc_known_c_suffix(suffix);
 	if (suffix == NULL || repl == NULL) {
@@ -617,6 +1871,49 @@ static bool btc_get_options(int *argc, const char ***argv)
 		fprintf(stderr, "bin2c: you need to specify -C or -H, or both\n");
 		return false;
 	}
+	if (btc_emit_incbin && btc_cfile == NULL) {
+		fprintf(stderr, "bin2c: --incbin requires -C\n");
+		return false;
+	}
+	if (btc_emit_wide != 0 && btc_emit_wide != 32 && btc_emit_wide != 64) {
+		fprintf(stderr, "bin2c: --wide only supports 32 and 64\n");
+		return false;
+	}
+	if (btc_align & (btc_align - 1)) {
+		fprintf(stderr, "bin2c: --align needs a power of two\n");
+		return false;
+	}
+	if (btc_section != NULL && strlen(btc_section) > 200) {
+		fprintf(stderr, "bin2c: section name is too long\n");
+		return false;
+	}
+	if (btc_toc && (btc_emit_wxbitmap || btc_emit_incbin ||
+	    btc_emit_compress)) {
+		fprintf(stderr, "bin2c: --toc is not supported with --wxbitmap, "
+		        "--incbin and --compress\n");
+		return false;
+	}
+	if (btc_align != 0)
+		snprintf(btc_attr_bss, sizeof(btc_attr_bss),
+		         " __attribute__((aligned(%u)))", btc_align);
+	if (btc_section == NULL)
+		strcpy(btc_attr_data, btc_attr_bss);
+	else if (btc_align != 0)
+		snprintf(btc_attr_data, sizeof(btc_attr_data),
+		         " __attribute__((aligned(%u), section(\"%s\")))",
+		         btc_align, btc_section);
+	else
+		snprintf(btc_attr_data, sizeof(btc_attr_data),
+		         " __attribute__((section(\"%s\")))", btc_section);
+	if (btc_endian == NULL) {
+		static const uint16_t probe = 0x100;
+		btc_big_endian = *(const unsigned char *)&probe != 0;
+	} else if (strcmp(btc_endian, "big") == 0) {
+		btc_big_endian = true;
+	} else if (strcmp(btc_endian, "little") != 0) {
+		fprintf(stderr, "bin2c: --endian must be \"big\" or \"little\"\n");
+		return false;
+	}
 	if (btc_cfile != NULL && btc_guard_name == NULL)
 		btc_guard_name = btc_construct_guard(btc_hfile);
 	if (btc_verbose) {
@@ -627,7 +1924,16 @@ static bool btc_get_options(int *argc, const char ***argv)
 		       (btc_guard_name != NULL) ? btc_guard_name : "");
 	}
 	btc_ops = btc_emit_wxbitmap ? &btc_wxbitmap_ops :
-	          btc_emit_ultra ? &btc_ultra_ops : &btc_stdc_ops;
+	          btc_emit_ultra ? &btc_ultra_ops :
+	          btc_emit_incbin ? &btc_incbin_ops :
+	          btc_emit_embed ? &btc_embed_ops :
+	          btc_emit_compress ? &btc_compress_ops :
+	          btc_emit_wide ? &btc_wide_ops : &btc_stdc_ops;
+	if (btc_dedup && btc_ops->file_alias == NULL) {
+		fprintf(stderr, "bin2c: WARNING: --dedup is not supported "
+		        "with --wxbitmap, ignoring\n");
+		btc_dedup = 0;
+	}
 	return true;
 }
 
@@ -637,6 +1943,8 @@ int main(int argc, const char **argv)
 
 	if (!btc_get_options(&argc, &argv))
 		return EXIT_FAILURE;
+	btc_init_tables();
+	btc_pagesize = sysconf(_SC_PAGESIZE);
 	ret = btc_start(argv);
 	HXmc_free(btc_cfile);
 	HXmc_free(btc_hfile);
@@ -25,6 +25,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -65,35 +66,97 @@ struct deleter {
 	void operator()(HXdir *d) { HXdir_close(d); }
 };
 
+struct map_entry {
+	uint32_t idx, uc;
+};
+
+/* On-disk cache of a parsed unicode map, see mapcache_load() */
+struct mapcache_header {
+	char magic[8];
+	uint64_t mtime_sec, mtime_nsec, size, entries, pathlen;
+};
+
 struct psf2_header {
 	uint8_t magic[4];
 	uint32_t version, headersize, flags, length, charsize, height, width;
 };
 
+/*
+ * The polygons of one glyph, with the edges of all polygons stored back to
+ * back. Capacity is kept across clear(), so that a single instance can serve
+ * all glyphs of a font without reallocating.
+ */
+struct polygon_set {
+	std::vector<edge> m_edge;
+	std::vector<size_t> m_end;
+
+	void clear() { m_edge.clear(); m_end.clear(); }
+	size_t size() const { return m_end.size(); }
+	const edge *begin(size_t i) const { return m_edge.data() + (i == 0 ? 0 : m_end[i-1]); }
+	const edge *end(size_t i) const { return m_edge.data() + m_end[i]; }
+};
+
+/*
+ * Converts glyphs to outlines. One instance is meant to be reused for all
+ * glyphs of a font (and per thread), so that the edge and polygon buffers
+ * need not be reallocated for every glyph.
+ */
 class vectorizer final {
 	public:
-	vectorizer(const glyph &, int descent = 0);
-	std::vector<std::vector<edge>> simple();
-	std::vector<std::vector<edge>> n1();
-	std::vector<std::vector<edge>> n2(unsigned int flags = 0);
+	vectorizer(int descent = 0) : m_descent(descent) {}
+	const polygon_set &simple(const glyph &);
+	const polygon_set &n1(const glyph &);
+	const polygon_set &n2(const glyph &, unsigned int flags = 0);
 
 	static constexpr const int scale_factor = 2;
 	static const unsigned int P_ISTHMUS = 1 << 1;
 
 	private:
+	void reset(const glyph &);
 	void make_squares();
 	void internal_edge_delete();
 	unsigned int neigh_edges(unsigned int dir, const vertex &, std::set<edge>::iterator &, std::set<edge>::iterator &) const;
 	std::set<edge>::iterator next_edge(unsigned int dir, const edge &, unsigned int flags) const;
-	std::vector<edge> pop_poly(unsigned int flags);
+	bool pop_poly(std::vector<edge> &, unsigned int flags);
 	void set(int, int);
 
-	const glyph &m_glyph;
+	const glyph *m_glyph = nullptr;
 	int m_descent = 0;
 	std::set<edge> emap;
+	polygon_set m_poly;
+	std::vector<edge> m_scratch;
+	std::vector<unsigned int> m_flags;
 	static const unsigned int P_SIMPLIFY_LINES = 1 << 0;
 };
 
+/*
+ * All glyphs of a font, converted once to the row-padded representation and
+ * stored back to back, so that they can be blitted a word at a time.
+ */
+class glyph_atlas final {
+	public:
+	glyph_atlas(const std::vector<glyph> &);
+	const char *operator[](size_t idx) const { return &m_data[m_offset[idx]]; }
+
+	private:
+	std::string m_data;
+	std::vector<size_t> m_offset;
+};
+
+/* A row-padded 1-bit drawing surface, which is exactly the PBM P4 layout. */
+class bitcanvas final {
+	public:
+	bitcanvas(const vfsize &);
+	void blit(const char *src, const vfsize &, const vfpos &);
+	std::string as_pbm() const;
+
+	vfsize m_size;
+
+	private:
+	size_t m_stride = 0;
+	std::string m_data;
+};
+
 static const char vfhex[] = "0123456789abcdef";
 
 static FILE *fopen(const char *name, const char *mode)
@@ -130,54 +193,270 @@ void unicode_map::add_i2u(unsigned int idx, char32_t uc)
 		r.first->second = idx;
 }
 
-int unicode_map::load(const char *file)
-{
-	std::unique_ptr<FILE, deleter> fp(fopen(file, "rb"));
-	if (fp == nullptr) {
-		fprintf(stderr, "Could not open %s: %s", file, strerror(errno));
-		return -errno;
+/* strtol(3) work-alike that does not look past @end */
+static const char *map_number(const char *p, const char *end, int base, long &out)
+{
+	auto start = p;
+	bool neg = false;
+	out = 0;
+	while (p < end && HX_isspace(*p))
+		++p;
+	if (p < end && (*p == '+' || *p == '-'))
+		neg = *p++ == '-';
+	if ((base == 0 || base == 16) && end - p > 2 && p[0] == '0' &&
+	    HX_tolower(p[1]) == 'x' && HX_isxdigit(p[2])) {
+		p += 2;
+		base = 16;
+	} else if (base == 0) {
+		base = p < end && *p == '0' ? 8 : 10;
 	}
-	size_t lnum = 0;
-	hxmc_t *line = nullptr;
-	auto lineclean = make_scope_success([&]() { HXmc_free(line); });
+	auto digits = p;
+	long v = 0;
+	for (; p < end; ++p) {
+		int d = HX_isdigit(*p) ? *p - '0' :
+		        HX_isalpha(*p) ? HX_tolower(*p) - 'a' + 10 : 36;
+		if (d >= base)
+			break;
+		v = v * base + d;
+	}
+	if (p == digits)
+		return start;
+	out = neg ? -v : v;
+	return p;
+}
 
-	while (HX_getl(&line, fp.get()) != nullptr) {
-		char *ptr = line, *end = nullptr;
-		while (HX_isspace(*ptr))
-			++ptr;
-		if (*ptr == '#')
+/**
+ * Tokenize a kbd-style unimap in one pass. The mappings are appended to
+ * @list in file order, which is needed to let later lines override earlier
+ * ones, as add_i2u would.
+ */
+static void map_parse(const char *p, const char *end, std::vector<map_entry> &list)
+{
+	size_t lnum = 0;
+	while (p < end) {
+		auto line = p;
+		auto eol = static_cast<const char *>(memchr(p, '\n', end - p));
+		if (eol == nullptr)
+			eol = end;
+		p = eol < end ? eol + 1 : end;
+		auto q = line;
+		while (q < eol && HX_isspace(*q))
+			++q;
+		if (q < eol && *q == '#')
 			continue;
-		HX_chomp(line);
-		int keyfrom = strtol(line, &end, 0), keyto = keyfrom;
+		while (eol > line && (eol[-1] == '\n' || eol[-1] == '\r'))
+			--eol;
+		long keyfrom, keyto;
+		auto e = map_number(line, eol, 0, keyfrom);
+		keyto = keyfrom;
 		++lnum;
 		do {
-			if (*end == '-')
-				keyto = strtol(end + 1, &end, 0);
-			ptr = end;
-			while (HX_isspace(*ptr) || *ptr == '\r')
-				++ptr;
-			if (*ptr == '\0' || *ptr == '\n' || *ptr == '#')
+			if (e < eol && *e == '-')
+				e = map_number(e + 1, eol, 0, keyto);
+			q = e;
+			while (q < eol && HX_isspace(*q))
+				++q;
+			if (q == eol || *q == '#')
 				break;
-			if (strcmp(ptr, "idem") == 0) {
+			if (eol - q == 4 && memcmp(q, "idem", 4) == 0) {
 				break;
-			} else if (ptr[0] != 'U') {
-				fprintf(stderr, "Warning: Unexpected char '%c' in unicode map line %zu.\n", ptr[0], lnum);
+			} else if (q[0] != 'U') {
+				fprintf(stderr, "Warning: Unexpected char '%c' in unicode map line %zu.\n", q[0], lnum);
 				break;
-			} else if (ptr[1] != '+') {
-				fprintf(stderr, "Warning: Unexpected char '%c' in unicode map line %zu.\n", ptr[1], lnum);
+			} else if (q + 1 == eol || q[1] != '+') {
+				fprintf(stderr, "Warning: Unexpected char '%c' in unicode map line %zu.\n", q + 1 < eol ? q[1] : '\0', lnum);
 				break;
 			}
 			if (keyfrom != keyto) {
-				fprintf(stderr, "Warning: No support for ranged mappings (0x%x-0x%x here) for anything but \"idem\".\n", keyfrom, keyto);
+				fprintf(stderr, "Warning: No support for ranged mappings (0x%x-0x%x here) for anything but \"idem\".\n",
+				        static_cast<int>(keyfrom), static_cast<int>(keyto));
 				break;
 			}
-			ptr += 2;
-			auto val = strtoul(ptr, &end, 16);
-			if (end == ptr)
+			q += 2;
+			long val;
+			e = map_number(q, eol, 16, val);
+			if (e == q)
 				break;
-			add_i2u(keyfrom, val);
+			list.push_back({static_cast<uint32_t>(keyfrom), static_cast<uint32_t>(val)});
 		} while (true);
 	}
+}
+
+static std::string mapcache_path(const std::string &source)
+{
+	std::string dir;
+	auto xdg = getenv("XDG_CACHE_HOME");
+	if (xdg != nullptr && *xdg != '\0') {
+		dir = xdg;
+	} else {
+		auto home = getenv("HOME");
+		if (home == nullptr || *home == '\0')
+			return {};
+		dir = home + std::string("/.cache");
+	}
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (auto c : source) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 0x100000001b3ULL;
+	}
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+	return dir + "/hxtools/unimap-" + buf;
+}
+
+/**
+ * Retrieve the mappings of @source from @cpath, provided the cache entry was
+ * made for the same path and the file's mtime and size have not changed.
+ * The entry count is only trusted if it matches the size of the cache file.
+ */
+static bool mapcache_load(const std::string &cpath, const std::string &source,
+    const struct stat &sb, std::vector<map_entry> &list)
+{
+	std::unique_ptr<FILE, deleter> fp(::fopen(cpath.c_str(), "rb"));
+	if (fp == nullptr)
+		return false;
+	struct mapcache_header hdr;
+	if (fread(&hdr, sizeof(hdr), 1, fp.get()) != 1 ||
+	    memcmp(hdr.magic, "VFAMAP1\n", sizeof(hdr.magic)) != 0 ||
+	    hdr.mtime_sec != static_cast<uint64_t>(sb.st_mtim.tv_sec) ||
+	    hdr.mtime_nsec != static_cast<uint64_t>(sb.st_mtim.tv_nsec) ||
+	    hdr.size != static_cast<uint64_t>(sb.st_size) ||
+	    hdr.pathlen != source.size())
+		return false;
+	struct stat csb;
+	if (fstat(fileno(fp.get()), &csb) < 0 ||
+	    static_cast<uint64_t>(csb.st_size) < sizeof(hdr) + hdr.pathlen)
+		return false;
+	auto body = static_cast<uint64_t>(csb.st_size) - sizeof(hdr) - hdr.pathlen;
+	if (body % sizeof(map_entry) != 0 || body / sizeof(map_entry) != hdr.entries)
+		return false;
+	std::string path(hdr.pathlen, '\0');
+	if (hdr.pathlen > 0 && fread(&path[0], hdr.pathlen, 1, fp.get()) != 1)
+		return false;
+	if (path != source)
+		return false;
+	auto start = list.size();
+	list.resize(start + hdr.entries);
+	if (hdr.entries > 0 &&
+	    fread(&list[start], sizeof(map_entry), hdr.entries, fp.get()) != hdr.entries) {
+		list.resize(start);
+		return false;
+	}
+	return true;
+}
+
+static void mapcache_save(const std::string &cpath, const std::string &source,
+    const struct stat &sb, const std::vector<map_entry> &list)
+{
+	auto slash = cpath.rfind('/');
+	if (HX_mkdir(cpath.substr(0, slash).c_str(), S_IRWXU) < 0)
+		return;
+	auto tmp = cpath + ".XXXXXX";
+	auto fd = mkstemp(&tmp[0]);
+	if (fd < 0)
+		return;
+	std::unique_ptr<FILE, deleter> fp(fdopen(fd, "wb"));
+	if (fp == nullptr) {
+		close(fd);
+		unlink(tmp.c_str());
+		return;
+	}
+	struct mapcache_header hdr{};
+	memcpy(hdr.magic, "VFAMAP1\n", sizeof(hdr.magic));
+	hdr.mtime_sec  = sb.st_mtim.tv_sec;
+	hdr.mtime_nsec = sb.st_mtim.tv_nsec;
+	hdr.size       = sb.st_size;
+	hdr.entries    = list.size();
+	hdr.pathlen    = source.size();
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, fp.get()) == 1 &&
+	          fwrite(source.c_str(), source.size(), 1, fp.get()) == 1 &&
+	          (list.size() == 0 ||
+	          fwrite(list.data(), sizeof(map_entry), list.size(), fp.get()) == list.size());
+	ok = fflush(fp.get()) == 0 && ok;
+	fp.reset();
+	if (!ok || rename(tmp.c_str(), cpath.c_str()) < 0)
+		unlink(tmp.c_str());
+}
+
+/**
+ * Equivalent to calling add_i2u for every element of @list in order, but
+ * sorts once and then inserts in key order.
+ */
+static void map_bulk_add(unicode_map &map, std::vector<map_entry> &list)
+{
+	/* U->I: the last mapping of a codepoint wins */
+	std::vector<map_entry> rev(list);
+	std::stable_sort(rev.begin(), rev.end(),
+		[](const map_entry &a, const map_entry &b) { return a.uc < b.uc; });
+	auto uhint = map.m_u2i.begin();
+	for (size_t i = 0; i < rev.size(); ++i) {
+		if (i + 1 < rev.size() && rev[i+1].uc == rev[i].uc)
+			continue;
+		uhint = std::next(map.m_u2i.insert_or_assign(uhint, rev[i].uc, rev[i].idx));
+	}
+
+	std::sort(list.begin(), list.end(), [](const map_entry &a, const map_entry &b) {
+		return std::tie(a.idx, a.uc) < std::tie(b.idx, b.uc);
+	});
+	auto ihint = map.m_i2u.begin();
+	for (size_t i = 0; i < list.size(); ) {
+		auto it = map.m_i2u.emplace_hint(ihint, list[i].idx, decltype(map.m_i2u)::mapped_type{});
+		auto &set = it->second;
+		auto idx = list[i].idx;
+		for (; i < list.size() && list[i].idx == idx; ++i)
+			set.emplace_hint(set.end(), list[i].uc);
+		ihint = std::next(it);
+	}
+}
+
+int unicode_map::load(const char *file)
+{
+	std::vector<map_entry> list;
+	if (strcmp(file, "-") == 0) {
+		std::string buf;
+		char chunk[4096];
+		size_t z;
+		while ((z = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+			buf.append(chunk, z);
+		map_parse(buf.data(), buf.data() + buf.size(), list);
+		map_bulk_add(*this, list);
+		return true;
+	}
+
+	auto fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		int saved_errno = errno;
+		fprintf(stderr, "Could not open %s: %s", file, strerror(errno));
+		return -saved_errno;
+	}
+	auto fdclean = make_scope_success([&]() { close(fd); });
+	struct stat sb;
+	if (fstat(fd, &sb) < 0)
+		return -errno;
+
+	std::string source, cpath;
+	auto real = realpath(file, nullptr);
+	if (real != nullptr) {
+		source = real;
+		free(real);
+		cpath = mapcache_path(source);
+	}
+	if (!cpath.empty() && mapcache_load(cpath, source, sb, list)) {
+		map_bulk_add(*this, list);
+		return true;
+	}
+	if (sb.st_size > 0) {
+		auto mapping = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED)
+			return -errno;
+		auto base = static_cast<const char *>(mapping);
+		map_parse(base, base + sb.st_size, list);
+		munmap(mapping, sb.st_size);
+	}
+	if (!cpath.empty())
+		mapcache_save(cpath, source, sb, list);
+	map_bulk_add(*this, list);
 	return true;
 }
 
@@ -885,6 +1164,83 @@ int font::save_psf(const char *file)
 	return 0;
 }
 
+int font::save_render(const char *file, const char *text)
+{
+	std::unique_ptr<FILE, deleter> fp(fmemopen(const_cast<char *>(text), strlen(text), "r"));
+	if (fp == nullptr)
+		return -errno;
+	return save_render_fp(file, fp.get());
+}
+
+int font::save_renderfile(const char *file, const char *textfile)
+{
+	std::unique_ptr<FILE, deleter> fp(fopen(textfile, "r"));
+	if (fp == nullptr)
+		return -errno;
+	return save_render_fp(file, fp.get());
+}
+
+int font::save_render_fp(const char *file, FILE *textfp)
+{
+	if (m_glyph.size() == 0)
+		return -EINVAL;
+	struct placement {
+		size_t idx;
+		vfpos pos;
+	};
+	std::vector<placement> plan;
+	unsigned int line_height = 0, max_width = 0, x = 0, y = 0;
+	for (const auto &g : m_glyph)
+		line_height = std::max(line_height, g.m_size.h);
+	bool pending_nl = false;
+	ssize_t fallback = -1;
+	if (m_unicode_map != nullptr)
+		fallback = m_unicode_map->to_index(0xFFFD);
+
+	for (auto uc = nextutf8(textfp); uc != ~0U; uc = nextutf8(textfp)) {
+		if (uc == '\r')
+			continue;
+		if (uc == '\n') {
+			if (pending_nl)
+				y += line_height;
+			pending_nl = true;
+			x = 0;
+			continue;
+		}
+		if (pending_nl) {
+			y += line_height;
+			pending_nl = false;
+		}
+		ssize_t idx = uc;
+		if (m_unicode_map != nullptr) {
+			idx = m_unicode_map->to_index(uc);
+			if (idx < 0)
+				idx = fallback;
+		}
+		if (idx < 0 || static_cast<size_t>(idx) >= m_glyph.size()) {
+			/* Unmapped codepoints still advance the pen */
+			x += m_glyph[0].m_size.w;
+		} else {
+			plan.push_back({static_cast<size_t>(idx), vfpos(x, y)});
+			x += m_glyph[idx].m_size.w;
+		}
+		max_width = std::max(max_width, x);
+	}
+
+	glyph_atlas atlas(m_glyph);
+	bitcanvas canvas(vfsize(max_width, plan.size() > 0 ? y + line_height : 0));
+	for (const auto &p : plan)
+		canvas.blit(atlas[p.idx], m_glyph[p.idx].m_size, p.pos);
+
+	std::unique_ptr<FILE, deleter> fp(fopen(file, "wb"));
+	if (fp == nullptr)
+		return -errno;
+	auto data = canvas.as_pbm();
+	if (fwrite(data.c_str(), data.size(), 1, fp.get()) != 1)
+		return -errno;
+	return 0;
+}
+
 std::pair<int, int> font::find_ascent_descent() const
 {
 	std::pair<int, int> asds{0, 0};
@@ -968,12 +1324,13 @@ int font::save_sfd(const char *file, enum vectoalg vt)
 	fprintf(fp, "TeXData: 1 0 0 346030 173015 115343 0 1048576 115343 783286 444596 497025 792723 393216 433062 380633 303038 157286 324010 404750 52429 2506097 1059062 262144\n");
 	fprintf(fp, "BeginChars: 65536 %zu\n\n", m_glyph.size());
 
+	vectorizer vec(asds.second);
 	if (m_unicode_map == nullptr) {
 		for (size_t idx = 0; idx < m_glyph.size(); ++idx)
-			save_sfd_glyph(fp, idx, idx, asds.first, asds.second, vt);
+			save_sfd_glyph(fp, idx, idx, vec, vt);
 	} else {
 		for (const auto &pair : m_unicode_map->m_u2i)
-			save_sfd_glyph(fp, pair.second, pair.first, asds.first, asds.second, vt);
+			save_sfd_glyph(fp, pair.second, pair.first, vec, vt);
 	}
 	fprintf(fp, "EndChars\n");
 	fprintf(fp, "EndSplineFont\n");
@@ -994,9 +1351,12 @@ static inline bool testbit_u(const glyph &g, int x, int y)
 	return g.m_data[bp.byte] & bp.mask;
 }
 
-vectorizer::vectorizer(const glyph &g, int desc) :
-	m_glyph(g), m_descent(desc)
-{}
+void vectorizer::reset(const glyph &g)
+{
+	m_glyph = &g;
+	emap.clear();
+	m_poly.clear();
+}
 
 void vectorizer::set(int x, int y)
 {
@@ -1012,12 +1372,12 @@ void vectorizer::set(int x, int y)
 
 void vectorizer::make_squares()
 {
-	const auto &sz = m_glyph.m_size;
+	const auto &sz = m_glyph->m_size;
 	for (unsigned int y = 0; y < sz.h; ++y) {
 		int yy = sz.h - 1 - static_cast<int>(y) - m_descent;
 		for (unsigned int x = 0; x < sz.w; ++x) {
 			bitpos ipos = y * sz.w + x;
-			if (m_glyph.m_data[ipos.byte] & ipos.mask)
+			if (m_glyph->m_data[ipos.byte] & ipos.mask)
 				set(x, yy);
 		}
 	}
@@ -1120,13 +1480,13 @@ std::set<edge>::iterator vectorizer::next_edge(unsigned int cur_dir,
 		bmp = cur_edge.end_vtx;
 	bmp.x /= scale_factor;
 	bmp.y /= scale_factor;
-	bmp.y = m_glyph.m_size.h - bmp.y - m_descent - 1;
+	bmp.y = m_glyph->m_size.h - bmp.y - m_descent - 1;
 
 	/* Test for pattern A1 */
-	bool up    = testbit_c(m_glyph, bmp.x, bmp.y - 2);
-	bool right = testbit_c(m_glyph, bmp.x + 2, bmp.y);
-	bool down  = testbit_c(m_glyph, bmp.x, bmp.y + 2);
-	bool left  = testbit_c(m_glyph, bmp.x - 2, bmp.y);
+	bool up    = testbit_c(*m_glyph, bmp.x, bmp.y - 2);
+	bool right = testbit_c(*m_glyph, bmp.x + 2, bmp.y);
+	bool down  = testbit_c(*m_glyph, bmp.x, bmp.y + 2);
+	bool left  = testbit_c(*m_glyph, bmp.x - 2, bmp.y);
 	if (cur_dir == 0 && left && up)
 		return inward;
 	if (cur_dir == 90 && up && right)
@@ -1137,32 +1497,35 @@ std::set<edge>::iterator vectorizer::next_edge(unsigned int cur_dir,
 		return inward;
 
 	/* Test for pattern A2 */
-	if (cur_dir == 0 && testbit_c(m_glyph, bmp.x - 2, bmp.y - 1) && testbit_c(m_glyph, bmp.x - 1, bmp.y - 2))
+	if (cur_dir == 0 && testbit_c(*m_glyph, bmp.x - 2, bmp.y - 1) && testbit_c(*m_glyph, bmp.x - 1, bmp.y - 2))
 		return inward;
-	if (cur_dir == 90 && testbit_c(m_glyph, bmp.x + 1, bmp.y - 2) && testbit_c(m_glyph, bmp.x + 2, bmp.y - 1))
+	if (cur_dir == 90 && testbit_c(*m_glyph, bmp.x + 1, bmp.y - 2) && testbit_c(*m_glyph, bmp.x + 2, bmp.y - 1))
 		return inward;
-	if (cur_dir == 180 && testbit_c(m_glyph, bmp.x + 2, bmp.y + 1) && testbit_c(m_glyph, bmp.x + 1, bmp.y + 2))
+	if (cur_dir == 180 && testbit_c(*m_glyph, bmp.x + 2, bmp.y + 1) && testbit_c(*m_glyph, bmp.x + 1, bmp.y + 2))
 		return inward;
-	if (cur_dir == 270 && testbit_c(m_glyph, bmp.x - 2, bmp.y + 1) && testbit_c(m_glyph, bmp.x - 1, bmp.y + 2))
+	if (cur_dir == 270 && testbit_c(*m_glyph, bmp.x - 2, bmp.y + 1) && testbit_c(*m_glyph, bmp.x - 1, bmp.y + 2))
 		return inward;
 
 	return outward;
 }
 
-std::vector<edge> vectorizer::pop_poly(unsigned int flags)
+/**
+ * Move the next polygon from @emap to the end of @poly.
+ */
+bool vectorizer::pop_poly(std::vector<edge> &poly, unsigned int flags)
 {
-	std::vector<edge> poly;
 	if (emap.size() == 0)
-		return poly;
+		return false;
+	auto first = poly.size();
 	poly.push_back(*emap.begin());
 	emap.erase(emap.begin());
-	auto prev_dir = poly[0].trivial_dir();
+	auto prev_dir = poly[first].trivial_dir();
 
 	while (true) {
 		if (emap.size() == 0)
 			break;
 		auto &tail_vtx = poly.rbegin()->end_vtx;
-		if (tail_vtx == poly.cbegin()->start_vtx)
+		if (tail_vtx == poly[first].start_vtx)
 			break;
 		auto next = next_edge(prev_dir, *poly.rbegin(), flags);
 		if (next == emap.cend()) {
@@ -1184,33 +1547,27 @@ std::vector<edge> vectorizer::pop_poly(unsigned int flags)
 		emap.erase(next);
 		prev_dir = next_dir;
 	}
-	return poly;
+	return true;
 }
 
-std::vector<std::vector<edge>> vectorizer::simple()
+const polygon_set &vectorizer::simple(const glyph &g)
 {
+	reset(g);
 	make_squares();
 	internal_edge_delete();
-	std::vector<std::vector<edge>> pmap;
-	while (true) {
-		auto poly = pop_poly(P_SIMPLIFY_LINES);
-		if (poly.size() == 0)
-			break;
-		pmap.push_back(std::move(poly));
-	}
-	return pmap;
+	while (pop_poly(m_poly.m_edge, P_SIMPLIFY_LINES))
+		m_poly.m_end.push_back(m_poly.m_edge.size());
+	return m_poly;
 }
 
-std::vector<std::vector<edge>> vectorizer::n1()
+const polygon_set &vectorizer::n1(const glyph &g)
 {
-	auto &g = m_glyph;
+	reset(g);
 	const auto &sz = g.m_size;
 	for (unsigned int uy = 0; uy < sz.h; ++uy) {
 		int y = sz.h - 1 - static_cast<int>(uy) - m_descent;
 		for (unsigned int ux = 0; ux < sz.w; ++ux) {
-			bitpos ipos = uy * sz.w + ux;
 			int x = ux;
-
 			bool c1 = testbit_c(g, ux - 1, uy + 1);
 			bool c2 = testbit_c(g, ux,     uy + 1);
 			bool c3 = testbit_c(g, ux + 1, uy + 1);
@@ -1257,21 +1614,46 @@ std::vector<std::vector<edge>> vectorizer::n1()
 	}
 
 	internal_edge_delete();
-	std::vector<std::vector<edge>> pmap;
-	while (true) {
-		auto poly = pop_poly(P_SIMPLIFY_LINES);
-		if (poly.size() == 0)
-			break;
-		pmap.push_back(std::move(poly));
-	}
-	return pmap;
+	while (pop_poly(m_poly.m_edge, P_SIMPLIFY_LINES))
+		m_poly.m_end.push_back(m_poly.m_edge.size());
+	return m_poly;
+}
+
+/* Move the end of @e one unit back */
+static inline void n2_pull_end(edge &e, unsigned int dir)
+{
+	if (dir == 0)
+		--e.end_vtx.y;
+	else if (dir == 90)
+		--e.end_vtx.x;
+	else if (dir == 180)
+		++e.end_vtx.y;
+	else if (dir == 270)
+		++e.end_vtx.x;
+}
+
+/* Move the start of @e one unit forward */
+static inline void n2_push_start(edge &e, unsigned int dir)
+{
+	if (dir == 0)
+		++e.start_vtx.y;
+	else if (dir == 90)
+		++e.start_vtx.x;
+	else if (dir == 180)
+		--e.start_vtx.y;
+	else if (dir == 270)
+		--e.start_vtx.x;
 }
 
-static void n2_angle(std::vector<edge> &poly)
+/**
+ * Append the smoothed version of @poly to @out. @flags is scratch space.
+ */
+static void n2_angle(const std::vector<edge> &poly,
+    std::vector<unsigned int> &flags, std::vector<edge> &out)
 {
 	static const unsigned int M_HEAD = 0x20, M_TAIL = 0x02,
 		M_XHEAD = 0x10, M_XTAIL = 0x01;
-	std::vector<unsigned int> flags(poly.size());
+	flags.assign(poly.size(), 0);
 
 	for (size_t xm3 = 0; xm3 < poly.size(); ++xm3) {
 		auto xm2 = (xm3 + 1) % poly.size();
@@ -1359,81 +1741,66 @@ static void n2_angle(std::vector<edge> &poly)
 		}
 	}
 
-	auto p_iter = poly.begin();
-	auto f_iter = flags.begin();
-	for (size_t ia = 0; ia < poly.size(); ++ia, ++p_iter, ++f_iter) {
-		auto ix = ia + 1;
-		auto ib = ix % poly.size();
-		if (!(flags[ia] & M_TAIL && flags[ib] & M_HEAD))
-			continue;
-		if ((flags[ia] & M_XTAIL) || (flags[ib] & M_XHEAD))
-			continue;
-
-		flags[ia] &= ~M_TAIL;
-		flags[ib] &= ~M_HEAD;
-		p_iter = poly.insert(std::next(p_iter), edge{{-64, -64}, {-64, -64}});
-		f_iter = flags.insert(std::next(f_iter), 0);
-		ib = (ia + 2) % poly.size();
-
-		auto da = poly[ia].trivial_dir(), db = poly[ib].trivial_dir();
-		if (da == 0)
-			--poly[ia].end_vtx.y;
-		else if (da == 90)
-			--poly[ia].end_vtx.x;
-		else if (da == 180)
-			++poly[ia].end_vtx.y;
-		else if (da == 270)
-			++poly[ia].end_vtx.x;
-		if (db == 0)
-			++poly[ib].start_vtx.y;
-		else if (db == 90)
-			++poly[ib].start_vtx.x;
-		else if (db == 180)
-			--poly[ib].start_vtx.y;
-		else if (db == 270)
-			--poly[ib].start_vtx.x;
-		poly[ix].start_vtx = poly[ia].end_vtx;
-		poly[ix].end_vtx   = poly[ib].start_vtx;
-		++ia;
-	}
-	poly.erase(std::remove_if(poly.begin(), poly.end(), [](const edge &e) {
-		return e.start_vtx == e.end_vtx;
-	}), poly.end());
-
-	p_iter = poly.begin();
-	while (p_iter != poly.cend()) {
-		auto next = std::next(p_iter);
-		if (next == poly.end())
-			break;
-		auto d1 = p_iter->trivial_dir(), d2 = next->trivial_dir();
-		if (d1 != d2) {
-			++p_iter;
-			continue;
+	/*
+	 * Cut the corners that were marked, and in the same forward scan, drop
+	 * edges that were reduced to nothing and coalesce collinear
+	 * neighbors. The cut between the last and the first edge is known
+	 * upfront, so that the first edge can be emitted in its final shape.
+	 */
+	auto n = poly.size();
+	auto cut = [&](size_t ia) -> bool {
+		auto ib = (ia + 1) % n;
+		return (flags[ia] & M_TAIL) && (flags[ib] & M_HEAD) &&
+		       !(flags[ia] & M_XTAIL) && !(flags[ib] & M_XHEAD);
+	};
+	auto first = out.size();
+	auto emit = [&](const edge &e) {
+		if (e.start_vtx == e.end_vtx)
+			return;
+		if (out.size() > first && out.back().trivial_dir() == e.trivial_dir())
+			out.back().end_vtx = e.end_vtx;
+		else
+			out.push_back(e);
+	};
+	auto head = poly[0];
+	if (cut(n - 1))
+		n2_push_start(head, poly[0].trivial_dir());
+	auto cur = head;
+	for (size_t ia = 0; ia < n; ++ia) {
+		auto ib = (ia + 1) % n;
+		auto next = ib == 0 ? head : poly[ib];
+		if (cut(ia)) {
+			n2_pull_end(cur, poly[ia].trivial_dir());
+			if (ib != 0)
+				n2_push_start(next, poly[ib].trivial_dir());
+			emit(cur);
+			emit(edge{cur.end_vtx, next.start_vtx});
+		} else {
+			emit(cur);
 		}
-		p_iter->end_vtx = next->end_vtx;
-		poly.erase(next);
+		cur = next;
 	}
 }
 
-std::vector<std::vector<edge>> vectorizer::n2(unsigned int flags)
+const polygon_set &vectorizer::n2(const glyph &g, unsigned int flags)
 {
+	reset(g);
 	flags &= P_ISTHMUS;
 	make_squares();
 	internal_edge_delete();
-	std::vector<std::vector<edge>> pmap;
 	while (true) {
 		/* Have all edges retian length 1 */
-		auto poly = pop_poly(flags);
-		if (poly.size() == 0)
+		m_scratch.clear();
+		if (!pop_poly(m_scratch, flags))
 			break;
-		n2_angle(poly);
-		pmap.push_back(std::move(poly));
+		n2_angle(m_scratch, m_flags, m_poly.m_edge);
+		m_poly.m_end.push_back(m_poly.m_edge.size());
 	}
-	return pmap;
+	return m_poly;
 }
 
-void font::save_sfd_glyph(FILE *fp, size_t idx, char32_t cp, int asc, int desc,
-    enum vectoalg vt)
+void font::save_sfd_glyph(FILE *fp, size_t idx, char32_t cp,
+    vectorizer &vec, enum vectoalg vt)
 {
 	unsigned int cpx = cp;
 	const auto &g = m_glyph[idx];
@@ -1445,20 +1812,20 @@ void font::save_sfd_glyph(FILE *fp, size_t idx, char32_t cp, int asc, int desc,
 	fprintf(fp, "Fore\n");
 	fprintf(fp, "SplineSet\n");
 
-	std::vector<std::vector<edge>> pmap;
-	if (vt == V_SIMPLE)
-		pmap = vectorizer(m_glyph[idx], desc).simple();
-	else if (vt == V_N1)
-		pmap = vectorizer(m_glyph[idx], desc).n1();
+	const polygon_set *pmap;
+	if (vt == V_N1)
+		pmap = &vec.n1(g);
 	else if (vt == V_N2)
-		pmap = vectorizer(m_glyph[idx], desc).n2();
+		pmap = &vec.n2(g);
 	else if (vt == V_N2EV)
-		pmap = vectorizer(m_glyph[idx], desc).n2(vectorizer::P_ISTHMUS);
-	for (const auto &poly : pmap) {
-		const auto &v1 = poly.cbegin()->start_vtx;
+		pmap = &vec.n2(g, vectorizer::P_ISTHMUS);
+	else
+		pmap = &vec.simple(g);
+	for (size_t pi = 0; pi < pmap->size(); ++pi) {
+		const auto &v1 = pmap->begin(pi)->start_vtx;
 		fprintf(fp, "%d %d m 25\n", v1.x, v1.y);
-		for (const auto &edge : poly)
-			fprintf(fp, " %d %d l 25\n", edge.end_vtx.x, edge.end_vtx.y);
+		for (auto edge = pmap->begin(pi); edge != pmap->end(pi); ++edge)
+			fprintf(fp, " %d %d l 25\n", edge->end_vtx.x, edge->end_vtx.y);
 	}
 	fprintf(fp, "EndSplineSet\n");
 	fprintf(fp, "EndChar\n");
@@ -1635,6 +2002,60 @@ std::string glyph::as_rowpad() const
 	return ret;
 }
 
+glyph_atlas::glyph_atlas(const std::vector<glyph> &gl)
+{
+	size_t total = 0;
+	m_offset.reserve(gl.size());
+	for (const auto &g : gl) {
+		m_offset.push_back(total);
+		total += bytes_per_glyph_rpad(g.m_size);
+	}
+	/* bitcanvas::blit loads 8 bytes at a time, hence the tail padding */
+	m_data.reserve(total + sizeof(uint64_t));
+	for (const auto &g : gl)
+		m_data += g.as_rowpad();
+	m_data.append(sizeof(uint64_t), '\0');
+}
+
+bitcanvas::bitcanvas(const vfsize &size) :
+	m_size(size), m_stride((size.w + 7) / 8)
+{
+	m_data.resize(m_stride * m_size.h + sizeof(uint64_t));
+}
+
+/**
+ * OR a row-padded bitmap of @sz into the canvas at @pos. Rows are moved in
+ * chunks of up to 56 bits, which leaves room for the sub-byte shift within
+ * one 64-bit word. @pos must lie such that the bitmap fits the canvas.
+ */
+void bitcanvas::blit(const char *src, const vfsize &sz, const vfpos &pos)
+{
+	auto src_stride = (sz.w + 7) / 8;
+	for (unsigned int y = 0; y < sz.h; ++y) {
+		auto sp = src + y * src_stride;
+		auto dp = &m_data[(pos.y + y) * m_stride];
+		for (unsigned int sx = 0; sx < sz.w; sx += 56) {
+			unsigned int nbits = std::min(56U, sz.w - sx);
+			unsigned int dx = pos.x + sx;
+			uint64_t sw, dw;
+			memcpy(&sw, sp + sx / CHAR_BIT, sizeof(sw));
+			sw = be64_to_cpu(sw) & (~0ULL << (64 - nbits));
+			memcpy(&dw, dp + dx / CHAR_BIT, sizeof(dw));
+			dw |= cpu_to_be64(sw >> (dx % CHAR_BIT));
+			memcpy(dp + dx / CHAR_BIT, &dw, sizeof(dw));
+		}
+	}
+}
+
+std::string bitcanvas::as_pbm() const
+{
+	char buf[HXSIZEOF_Z32*3];
+	snprintf(buf, sizeof(buf), "P4\n%u %u\n", m_size.w, m_size.h);
+	std::string ret = buf;
+	ret.append(m_data, 0, m_stride * m_size.h);
+	return ret;
+}
+
 bool vertex::operator<(const struct vertex &o) const
 {
 	return std::tie(y, x) < std::tie(o.y, o.x);
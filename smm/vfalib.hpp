@@ -85,6 +85,8 @@ enum vectoalg {
 	V_N2EV,
 };
 
+class vectorizer;
+
 class glyph {
 	public:
 	glyph() = default;
@@ -122,6 +124,8 @@ class font {
 	int save_map(const char *file);
 	int save_pbm(const char *dir);
 	int save_psf(const char *file);
+	int save_render(const char *file, const char *text);
+	int save_renderfile(const char *file, const char *textfile);
 	int save_sfd(const char *file, enum vectoalg);
 	int save_clt(const char *dir);
 	void blit(const vfrect &src, const vfrect &dst)
@@ -141,10 +145,11 @@ class font {
 	private:
 	std::pair<int, int> find_ascent_descent() const;
 	int load_clt_glyph(FILE *, glyph &);
+	int save_render_fp(const char *file, FILE *text);
 	void save_bdf_glyph(FILE *, size_t idx, char32_t cp);
 	int save_clt_glyph(const char *dir, size_t n, char32_t cp);
 	int save_pbm_glyph(const char *dir, size_t n, char32_t cp);
-	void save_sfd_glyph(FILE *, size_t idx, char32_t cp, int, int, enum vectoalg);
+	void save_sfd_glyph(FILE *, size_t idx, char32_t cp, vectorizer &, enum vectoalg);
 
 	public:
 	std::vector<glyph> m_glyph;
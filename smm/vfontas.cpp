@@ -208,6 +208,24 @@ static bool vf_loadpsf(font &f, char **args)
 	return false;
 }
 
+static bool vf_render(font &f, char **args)
+{
+	auto ret = f.save_render(args[1], args[0]);
+	if (ret >= 0)
+		return true;
+	fprintf(stderr, "Error saving %s: %s\n", args[1], strerror(-ret));
+	return false;
+}
+
+static bool vf_renderfile(font &f, char **args)
+{
+	auto ret = f.save_renderfile(args[1], args[0]);
+	if (ret >= 0)
+		return true;
+	fprintf(stderr, "Error rendering %s to %s: %s\n", args[0], args[1], strerror(-ret));
+	return false;
+}
+
 static bool vf_savebdf(font &f, char **args)
 {
 	auto ret = f.save_bdf(args[0]);
@@ -474,6 +492,8 @@ static const struct vf_command {
 	{"loadhex", 1, vf_loadhex},
 	{"loadmap", 1, vf_loadmap},
 	{"loadpsf", 1, vf_loadpsf},
+	{"render", 2, vf_render},
+	{"renderfile", 2, vf_renderfile},
 	{"savebdf", 1, vf_savebdf},
 	{"saveclt", 1, vf_saveclt},
 	{"savefnt", 1, vf_savefnt},
@@ -6,105 +6,916 @@
  *	modify it under the terms of the WTF Public License version 2 or
  *	(at your option) any later version.
  */
+#define _GNU_SOURCE 1
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <libHX/defs.h>
+#include <libHX/init.h>
+#include <libHX/option.h>
 #include <libHX/string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include "config.h"
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(HAVE_LINUX_FS_H)
+#	include <linux/fiemap.h>
+#	include <linux/fs.h>
+#endif
 
-static void dofile(const char *file)
+enum {
+	DC_FAILED = -1,
+	DC_PENDING,
+	DC_DONE,
+	DC_SKIPPED,
+};
+
+enum {
+	DC_FIEMAP_COUNT = 128,
+	DC_BUFSIZE = 1 << 20,
+	DC_STREAM_SIZE = 8 << 20,
+};
+
+struct dc_range {
+	off_t off, len;
+};
+
+/**
+ * A file to declone. With -r, @root is a descriptor on the directory given
+ * as argument, and @path + @rel is the path below it, which is looked up
+ * without following symlinks. Otherwise @root is -1, and @path is used as
+ * given.
+ */
+struct dc_file {
+	char *path;
+	off_t size;
+	int root;
+	size_t rel;
+};
+
+/**
+ * The files to declone (@file), and for -r, the directories given as
+ * arguments (@root) and a descriptor on each filesystem visited (@fs), for
+ * the syncfs at the end.
+ */
+struct dc_list {
+	struct dc_file *file;
+	size_t nfiles;
+	int *root;
+	size_t nroots;
+	struct dc_fs {
+		dev_t dev;
+		int fd;
+	} *fs;
+	size_t nfs;
+};
+
+/**
+ * @status:	DC_PENDING, or the result of dofile
+ */
+struct dc_job {
+	const struct dc_file *file;
+	int status;
+};
+
+/**
+ * @order:	the jobs by descending size, so that the huge files start first
+ * 		rather than becoming the tail
+ * @next:	index into @order of the next job to hand out
+ * @printed:	number of jobs (in argument order) whose result has been shown
+ */
+struct dc_pool {
+	pthread_mutex_t lock;
+	struct dc_job *job, **order;
+	size_t njobs, next, printed;
+};
+
+static unsigned int dc_nthreads;
+static int dc_force, dc_inplace, dc_stream, dc_recursive;
+static unsigned long long dc_min_size;
+static unsigned long long dc_rewritten, dc_skipped;
+static unsigned int dc_seq;
+
+static void dc_account(unsigned long long rewritten,
+    unsigned long long skipped)
+{
+	__atomic_fetch_add(&dc_rewritten, rewritten, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dc_skipped, skipped, __ATOMIC_RELAXED);
+}
+
+/**
+ * Collect the ranges of @fd (clipped to @size) whose extents are shared
+ * with other files (reflinks, snapshots), as reported by FIEMAP. Returns
+ * the number of shared bytes, or -1 if the filesystem cannot tell. The
+ * number of bytes in data extents, shared or not, goes to @*data.
+ */
+static off_t dc_shared_ranges(int fd, off_t size, struct dc_range **list,
+    size_t *nlist, off_t *data)
+{
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(HAVE_LINUX_FS_H)
+	struct fiemap *fm;
+	struct dc_range *nr;
+	off_t shared = 0, off, end;
+	uint64_t start = 0;
+	bool last = false;
+	unsigned int i;
+
+	*list = NULL;
+	*nlist = 0;
+	*data = 0;
+	fm = malloc(sizeof(*fm) + DC_FIEMAP_COUNT * sizeof(*fm->fm_extents));
+	if (fm == NULL)
+		return -1;
+	while (!last && start < (uint64_t)size) {
+		memset(fm, 0, sizeof(*fm));
+		fm->fm_start        = start;
+		fm->fm_length       = FIEMAP_MAX_OFFSET - start;
+		fm->fm_extent_count = DC_FIEMAP_COUNT;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+			free(*list);
+			free(fm);
+			return -1;
+		}
+		if (fm->fm_mapped_extents == 0)
+			break;
+		for (i = 0; i < fm->fm_mapped_extents; ++i) {
+			const struct fiemap_extent *fe = &fm->fm_extents[i];
+
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				last = true;
+			start = fe->fe_logical + fe->fe_length;
+			if ((off_t)fe->fe_logical >= size)
+				continue;
+			off = fe->fe_logical;
+			end = start < (uint64_t)size ? (off_t)start : size;
+			*data += end - off;
+			if (!(fe->fe_flags & FIEMAP_EXTENT_SHARED))
+				continue;
+			shared += end - off;
+			if (*nlist > 0 && (*list)[*nlist-1].off +
+			    (*list)[*nlist-1].len == off) {
+				(*list)[*nlist-1].len += end - off;
+				continue;
+			}
+			if ((*nlist & (*nlist - 1)) == 0) {
+				nr = realloc(*list, sizeof(*nr) * (*nlist * 2 + 1));
+				if (nr == NULL) {
+					free(*list);
+					free(fm);
+					return -1;
+				}
+				*list = nr;
+			}
+			(*list)[*nlist].off = off;
+			(*list)[(*nlist)++].len = end - off;
+		}
+	}
+	free(fm);
+	return shared;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Rewrite the shared ranges of @file in place, which gives them their own
+ * blocks: with FALLOC_FL_UNSHARE_RANGE where supported, else by writing
+ * back what was read, which the filesystem has to copy-on-write. The
+ * contents do not change, so neither do the timestamps.
+ */
+static bool dc_unshare(const char *file, int dfd, const char *base,
+    const struct stat *sb, const struct dc_range *r, size_t n)
+{
+	const struct timespec ts[2] = {sb->st_atim, sb->st_mtim};
+	struct stat osb;
+	char *buf = NULL;
+	bool ok = true;
+	ssize_t ret;
+	off_t done;
+	size_t i;
+	int fd;
+
+	fd = openat(dfd, base, O_RDWR | (dc_recursive ? O_NOFOLLOW : 0));
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n",
+		        file, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &osb) < 0 || osb.st_dev != sb->st_dev ||
+	    osb.st_ino != sb->st_ino) {
+		fprintf(stderr, "%s was replaced meanwhile\n", file);
+		close(fd);
+		return false;
+	}
+	for (i = 0; ok && i < n; ++i) {
+#ifdef FALLOC_FL_UNSHARE_RANGE
+		if (fallocate(fd, FALLOC_FL_UNSHARE_RANGE, r[i].off,
+		    r[i].len) == 0)
+			continue;
+		if (errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS) {
+			fprintf(stderr, "fallocate %s: %s\n",
+			        file, strerror(errno));
+			ok = false;
+			break;
+		}
+#endif
+		if (buf == NULL && (buf = malloc(DC_BUFSIZE)) == NULL) {
+			perror("malloc");
+			ok = false;
+			break;
+		}
+		for (done = 0; done < r[i].len; done += ret) {
+			ret = pread(fd, buf, r[i].len - done < DC_BUFSIZE ?
+			      r[i].len - done : DC_BUFSIZE, r[i].off + done);
+			if (ret > 0)
+				ret = pwrite(fd, buf, ret, r[i].off + done);
+			if (ret <= 0) {
+				fprintf(stderr, "rewrite %s: %s\n", file,
+				        ret < 0 ? strerror(errno) : "short file");
+				ok = false;
+				break;
+			}
+		}
+	}
+	free(buf);
+	if (ok && futimens(fd, ts) < 0)
+		fprintf(stderr, "futimens %s: %s\n", file, strerror(errno));
+	if (close(fd) < 0 && ok) {
+		fprintf(stderr, "close %s: %s\n", file, strerror(errno));
+		ok = false;
+	}
+	return ok;
+}
+
+/**
+ * A file with a single link needs decloning only if it shares extents.
+ * Returns DC_SKIPPED if it does not, the result of the in-place rewrite
+ * with -i, or DC_PENDING to go on with a copy of the whole file.
+ */
+static int dc_check_shared(const char *file, int dfd, const char *base,
+    int fd, const struct stat *sb)
+{
+	struct dc_range *list;
+	size_t n;
+	off_t data, shared = dc_shared_ranges(fd, sb->st_size, &list, &n, &data);
+	int ret = DC_PENDING;
+
+	if (shared < 0)
+		/* Cannot tell, so declone it to be sure. */
+		return DC_PENDING;
+	/* Holes are neither rewritten nor skipped. */
+	if (shared == 0) {
+		dc_account(0, data);
+		ret = DC_SKIPPED;
+	} else if (dc_inplace) {
+		ret = dc_unshare(file, dfd, base, sb, list, n) ?
+		      DC_DONE : DC_FAILED;
+		if (ret == DC_DONE)
+			dc_account(shared, data - shared);
+	}
+	free(list);
+	return ret;
+}
+
+/**
+ * Copy all of @infd at once through two mappings. Holes are read as zeros
+ * and written out as such. Returns the number of bytes copied, or -1.
+ */
+static off_t dc_copy_mmap(int infd, int outfd, const struct stat *sb,
+    const char *outname)
+{
+	off_t ret = -1;
+
+	if (sb->st_size == 0)
+		return 0;
+	void *inmap = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, infd, 0);
+	if (inmap == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		return -1;
+	}
+	void *outmap = mmap(NULL, sb->st_size, PROT_WRITE, MAP_SHARED, outfd, 0);
+	if (outmap == MAP_FAILED) {
+		fprintf(stderr, "mmap %s: %s\n", outname, strerror(errno));
+		goto out;
+	}
+	memcpy(outmap, inmap, sb->st_size);
+	/* With -r, syncfs at the end takes care of it. */
+	if (!dc_recursive && msync(outmap, sb->st_size, MS_ASYNC) < 0)
+		fprintf(stderr, "msync: %s\n", strerror(errno));
+	else
+		ret = sb->st_size;
+	munmap(outmap, sb->st_size);
+ out:
+	munmap(inmap, sb->st_size);
+	return ret;
+}
+
+/**
+ * Copy the data extents of @infd through one DC_STREAM_SIZE buffer, so
+ * that memory use does not grow with the file size, and holes stay holes.
+ * Each block of the source is dropped from the page cache once read. The
+ * writeback of each block of the copy is started right away, and the
+ * previous block is waited for and dropped as well.
+ *
+ * copy_file_range(2) is not used: on btrfs and XFS it makes reflinks,
+ * which would leave the extents shared. Returns the number of bytes copied,
+ * or -1.
+ */
+static off_t dc_copy_stream(int infd, int outfd, const struct stat *sb,
+    const char *outname)
 {
+	off_t data, hole = 0, off, poff = 0, plen = 0, copied = 0;
+	char *buf = malloc(DC_STREAM_SIZE);
+	ssize_t rd, wr, done;
+	bool ok = buf != NULL;
+
+	if (buf == NULL)
+		perror("malloc");
+	while (ok && hole < sb->st_size) {
+		data = lseek(infd, hole, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data < 0) {
+			/* No SEEK_DATA support, copy everything. */
+			data = hole;
+			hole = sb->st_size;
+		} else {
+			hole = lseek(infd, data, SEEK_HOLE);
+			if (hole < 0 || hole > sb->st_size)
+				hole = sb->st_size;
+		}
+		for (off = data; ok && off < hole; off += rd) {
+			rd = pread(infd, buf, hole - off < DC_STREAM_SIZE ?
+			     hole - off : DC_STREAM_SIZE, off);
+			if (rd <= 0) {
+				fprintf(stderr, "read: %s\n", rd < 0 ?
+				        strerror(errno) : "file got shorter");
+				ok = false;
+				break;
+			}
+			for (done = 0; done < rd; done += wr) {
+				wr = pwrite(outfd, buf + done, rd - done,
+				     off + done);
+				if (wr < 0) {
+					fprintf(stderr, "write %s: %s\n",
+					        outname, strerror(errno));
+					ok = false;
+					break;
+				}
+			}
+			copied += rd;
+			posix_fadvise(infd, off, rd, POSIX_FADV_DONTNEED);
+#ifdef HAVE_SYNC_FILE_RANGE
+			sync_file_range(outfd, off, rd, SYNC_FILE_RANGE_WRITE);
+			if (plen > 0) {
+				sync_file_range(outfd, poff, plen,
+					SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER);
+				posix_fadvise(outfd, poff, plen,
+					POSIX_FADV_DONTNEED);
+			}
+			poff = off;
+			plen = rd;
+#endif
+		}
+	}
+	free(buf);
+	/*
+	 * The copy must be on disk before it replaces the original, unless
+	 * -r syncs all filesystems at the end.
+	 */
+	if (ok && !dc_recursive && fsync(outfd) < 0) {
+		fprintf(stderr, "fsync %s: %s\n", outname, strerror(errno));
+		ok = false;
+	}
+	if (ok && plen > 0)
+		posix_fadvise(outfd, poff, plen, POSIX_FADV_DONTNEED);
+	return ok ? copied : -1;
+}
+
+/**
+ * Open the directory that @f is in, and point @*base to its name therein.
+ * Below a -r root, each component is opened with O_NOFOLLOW, so a directory
+ * that was swapped for a symlink after the walk is not followed.
+ */
+static int dc_open_dir(const struct dc_file *f, const char **base)
+{
+	const char *p, *slash;
+	int dfd, nfd, err;
+	char *comp;
+
+	if (f->root < 0) {
+		char *dir = HX_dirname(f->path);
+
+		if (dir == NULL)
+			return -1;
+		slash = strrchr(f->path, '/');
+		*base = slash != NULL ? slash + 1 : f->path;
+		dfd = open(dir, O_RDONLY | O_DIRECTORY);
+		free(dir);
+		return dfd;
+	}
+	dfd = dup(f->root);
+	for (p = f->path + f->rel; dfd >= 0 &&
+	    (slash = strchr(p, '/')) != NULL; p = slash + 1) {
+		comp = strndup(p, slash - p);
+		nfd = comp == NULL ? -1 :
+		      openat(dfd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		err = errno;
+		free(comp);
+		close(dfd);
+		dfd = nfd;
+		errno = err;
+	}
+	*base = p;
+	return dfd;
+}
+
+/* A temporary name for the copy, unique within this process. */
+static void dc_tmpname(char *name, size_t size)
+{
+	snprintf(name, size, ".declone.%u.%u", (unsigned int)getpid(),
+	         __atomic_fetch_add(&dc_seq, 1, __ATOMIC_RELAXED));
+}
+
+/**
+ * Create the copy as an unnamed file (O_TMPFILE) in @dfd, which only gets
+ * a name once it is complete, so that no half-written temporary files are
+ * visible, or left behind by a crash. Where that is not supported, a named
+ * file is created, whose name is returned in @name (else it is empty).
+ */
+static int dc_open_tmp(int dfd, char *name, size_t size)
+{
+	int fd;
+
+	*name = '\0';
+#ifdef O_TMPFILE
+	fd = openat(dfd, ".", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd >= 0)
+		return fd;
+	/* Kernels without O_TMPFILE see O_DIRECTORY and say EISDIR. */
+	if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+		return -1;
+#endif
+	do {
+		dc_tmpname(name, size);
+		fd = openat(dfd, name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+		     S_IRUSR | S_IWUSR);
+	} while (fd < 0 && errno == EEXIST);
+	if (fd < 0)
+		*name = '\0';
+	return fd;
+}
+
+/**
+ * Put the copy in place of @base in @dfd. An O_TMPFILE copy (empty @name)
+ * is first linked in under a name that did not exist, as linkat cannot
+ * replace anything. AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, /proc does not.
+ */
+static bool dc_replace(int fd, int dfd, char *name, size_t size,
+    const char *base, const char *file)
+{
+	char proc[64];
+	int err;
+
+	while (*name == '\0') {
+		dc_tmpname(name, size);
+		if (linkat(fd, "", dfd, name, AT_EMPTY_PATH) == 0)
+			break;
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+		if (linkat(AT_FDCWD, proc, dfd, name, AT_SYMLINK_FOLLOW) == 0)
+			break;
+		err = errno;
+		*name = '\0';
+		if (err != EEXIST) {
+			fprintf(stderr, "linkat %s: %s\n", file, strerror(err));
+			return false;
+		}
+	}
+	if (renameat(dfd, name, dfd, base) < 0) {
+		fprintf(stderr, "Could not replace %s: %s\n",
+		        file, strerror(errno));
+		return false;
+	}
+	*name = '\0';
+	return true;
+}
+
+static int dofile(const struct dc_file *f)
+{
+	const char *file = f->path, *base;
+	int ret = DC_FAILED, infd, outfd = -1;
+	char outname[64] = "";
 	struct stat sb;
-	int infd = open(file, O_RDONLY);
+	off_t copied;
+	int dfd = dc_open_dir(f, &base);
+	if (dfd < 0) {
+		fprintf(stderr, "Could not open the directory of %s: %s\n",
+		        file, strerror(errno));
+		return DC_FAILED;
+	}
+	infd = openat(dfd, base, O_RDONLY | (dc_recursive ? O_NOFOLLOW : 0));
 	if (infd < 0) {
 		fprintf(stderr, "Could not open %s: %s\n",
 		        file, strerror(errno));
-		return;
+		close(dfd);
+		return DC_FAILED;
 	}
 	if (fstat(infd, &sb) < 0) {
 		fprintf(stderr, "Could not stat %s: %s\n",
 		        file, strerror(errno));
 		goto out;
 	}
-	void *inmap = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, infd, 0);
-	if (inmap == MAP_FAILED) {
-		fprintf(stderr, "mmap %s: %s\n", file, strerror(errno));
+	if (!dc_force && sb.st_nlink == 1) {
+		ret = dc_check_shared(file, dfd, base, infd, &sb);
+		if (ret != DC_PENDING)
+			goto out;
+		ret = DC_FAILED;
+	}
+
+	outfd = dc_open_tmp(dfd, outname, sizeof(outname));
+	if (outfd < 0) {
+		fprintf(stderr, "Could not create a copy of %s: %s\n",
+		        file, strerror(errno));
+		goto out;
+	}
+	if (ftruncate(outfd, sb.st_size) < 0) {
+		fprintf(stderr, "ftruncate %s: %s\n", file, strerror(errno));
+		goto out;
+	}
+	if (fchown(outfd, sb.st_uid, sb.st_gid) < 0 ||
+	    fchmod(outfd, sb.st_mode) < 0) {
+		fprintf(stderr, "fchown/fchmod %s: %s\n", file, strerror(errno));
 		goto out;
 	}
+	copied = (dc_stream ? dc_copy_stream : dc_copy_mmap)(infd, outfd,
+	         &sb, file);
+	if (copied < 0)
+		goto out;
+	if (!dc_replace(outfd, dfd, outname, sizeof(outname), base, file))
+		goto out;
+	dc_account(copied, 0);
+	ret = DC_DONE;
+ out:
+	if (outfd >= 0)
+		close(outfd);
+	if (*outname != '\0')
+		unlinkat(dfd, outname, 0);
+	close(infd);
+	close(dfd);
+	return ret;
+}
+
+static void *dc_worker(void *arg)
+{
+	struct dc_pool *pool = arg;
+	struct dc_job *job;
+	int ret;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next == pool->njobs) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = pool->order[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
 
-	char *cont_dir = HX_dirname(file);
-	if (cont_dir == NULL) {
-		fprintf(stderr, "%s\n", strerror(errno));
-		goto out2;
+		ret = dofile(job->file);
+
+		pthread_mutex_lock(&pool->lock);
+		job->status = ret;
+		/* Show the results in argument order, as far as they are done. */
+		for (; pool->printed < pool->njobs; ++pool->printed) {
+			job = &pool->job[pool->printed];
+			if (job->status == DC_PENDING)
+				break;
+			if (job->status == DC_DONE)
+				printf("* %s\n", job->file->path);
+		}
+		pthread_mutex_unlock(&pool->lock);
 	}
-	hxmc_t *outname = HXmc_strinit(cont_dir);
-	if (outname == NULL) {
-		fprintf(stderr, "%s\n", strerror(errno));
-		goto out3;
+	return NULL;
+}
+
+static int dc_size_cmp(const void *pa, const void *pb)
+{
+	const struct dc_job *a = *(const struct dc_job *const *)pa;
+	const struct dc_job *b = *(const struct dc_job *const *)pb;
+
+	if (a->file->size != b->file->size)
+		return a->file->size > b->file->size ? -1 : 1;
+	return a < b ? -1 : a > b;
+}
+
+/**
+ * Declone the files of @l with dc_nthreads threads.
+ */
+static int dc_parallel(const struct dc_list *l)
+{
+	struct dc_pool pool = {.njobs = l->nfiles};
+	unsigned int nthr = 0, i;
+	pthread_t *thr;
+	int ret;
+
+	pool.job   = calloc(l->nfiles, sizeof(*pool.job));
+	pool.order = calloc(l->nfiles, sizeof(*pool.order));
+	thr        = calloc(dc_nthreads, sizeof(*thr));
+	if (pool.job == NULL || pool.order == NULL || thr == NULL) {
+		perror("calloc");
+		free(pool.job);
+		free(pool.order);
+		free(thr);
+		return EXIT_FAILURE;
 	}
-	if (HXmc_strcat(&outname, "/decloneXXXXXX") == NULL) {
-		fprintf(stderr, "%s\n", strerror(errno));
-		goto out4;
+	for (i = 0; i < pool.njobs; ++i) {
+		pool.job[i].file = &l->file[i];
+		pool.order[i] = &pool.job[i];
 	}
-	if (mkstemp(outname) < 0) {
-		fprintf(stderr, "mkstemp: %s\n", strerror(errno));
-		goto out4;
+	qsort(pool.order, pool.njobs, sizeof(*pool.order), dc_size_cmp);
+	pthread_mutex_init(&pool.lock, NULL);
+	for (; nthr < dc_nthreads && nthr < pool.njobs; ++nthr) {
+		ret = pthread_create(&thr[nthr], NULL, dc_worker, &pool);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			break;
+		}
 	}
-	int outfd = open(outname, O_RDWR, S_IRUGO | S_IWUGO);
-	if (outfd < 0) {
-		fprintf(stderr, "open %s: %s\n", outname, strerror(errno));
-		goto out4;
+	if (nthr == 0)
+		dc_worker(&pool);
+	for (i = 0; i < nthr; ++i)
+		pthread_join(thr[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	free(thr);
+	free(pool.order);
+	free(pool.job);
+	return EXIT_SUCCESS;
+}
+
+/* Remember one descriptor per filesystem, to syncfs them at the end. */
+static void dc_note_fs(struct dc_list *l, int fd, dev_t dev)
+{
+	struct dc_fs *nfs;
+	size_t i;
+
+	for (i = 0; i < l->nfs; ++i)
+		if (l->fs[i].dev == dev)
+			return;
+	nfs = realloc(l->fs, sizeof(*nfs) * (l->nfs + 1));
+	if (nfs == NULL)
+		return;
+	l->fs = nfs;
+	l->fs[l->nfs].dev = dev;
+	l->fs[l->nfs].fd = dup(fd);
+	if (l->fs[l->nfs].fd >= 0)
+		++l->nfs;
+}
+
+static bool dc_add_file(struct dc_list *l, char *path, off_t size, int root,
+    size_t rel)
+{
+	struct dc_file *nf;
+
+	if ((l->nfiles & (l->nfiles - 1)) == 0) {
+		nf = realloc(l->file, sizeof(*nf) * (l->nfiles * 2 + 1));
+		if (nf == NULL) {
+			perror("realloc");
+			free(path);
+			return false;
+		}
+		l->file = nf;
 	}
-	if (ftruncate(outfd, sb.st_size) < 0) {
-		fprintf(stderr, "ftruncate %s: %s\n", outname, strerror(errno));
-		goto out5;
+	nf = &l->file[l->nfiles++];
+	nf->path = path;
+	nf->size = size;
+	nf->root = root;
+	nf->rel  = rel;
+	return true;
+}
+
+/**
+ * Collect the regular files of at least dc_min_size bytes below the
+ * directory @dfd (named @path), with lookups relative to it. Symlinks are
+ * never followed. The files are recorded relative to @root, whose name
+ * takes up the first @rel bytes of their paths.
+ */
+static void dc_walk(struct dc_list *l, int dfd, const char *path, int root,
+    size_t rel)
+{
+	const struct dirent *de;
+	struct stat sb;
+	hxmc_t *sub;
+	DIR *dh;
+	int fd;
+
+	fd = dup(dfd);
+	dh = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dh == NULL) {
+		fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
 	}
-	if (fchown(outfd, sb.st_uid, sb.st_gid) < 0 ||
-	    fchmod(outfd, sb.st_mode) < 0) {
-		fprintf(stderr, "fchown/fchmod %s: %s\n", outname, strerror(errno));
-		goto out5;
+	while ((de = readdir(dh)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(dfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+			fprintf(stderr, "Could not stat %s/%s: %s\n",
+			        path, de->d_name, strerror(errno));
+			continue;
+		}
+		if (!S_ISDIR(sb.st_mode) && (!S_ISREG(sb.st_mode) ||
+		    (unsigned long long)sb.st_size < dc_min_size))
+			continue;
+		sub = HXmc_strinit(path);
+		if (sub == NULL || HXmc_strcat(&sub, "/") == NULL ||
+		    HXmc_strcat(&sub, de->d_name) == NULL) {
+			perror("malloc");
+			HXmc_free(sub);
+			break;
+		}
+		if (S_ISREG(sb.st_mode)) {
+			char *copy = strdup(sub);
+
+			HXmc_free(sub);
+			if (copy == NULL ||
+			    !dc_add_file(l, copy, sb.st_size, root, rel))
+				break;
+			continue;
+		}
+		fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0) {
+			fprintf(stderr, "Could not open %s: %s\n",
+			        sub, strerror(errno));
+		} else {
+			dc_note_fs(l, fd, sb.st_dev);
+			dc_walk(l, fd, sub, root, rel);
+			close(fd);
+		}
+		HXmc_free(sub);
 	}
-	void *outmap = mmap(NULL, sb.st_size, PROT_WRITE, MAP_SHARED, outfd, 0);
-	if (outmap == MAP_FAILED) {
-		fprintf(stderr, "mmap %s: %s\n", outname, strerror(errno));
-		goto out5;
+	closedir(dh);
+}
+
+/**
+ * Expand the arguments for -r: directories are walked (and stay open as
+ * the roots for their files), files are taken as they are (if large
+ * enough).
+ */
+static bool dc_collect(struct dc_list *l, int argc, const char **argv)
+{
+	struct stat sb;
+	char *path;
+	int *nr, i, fd;
+
+	for (i = 0; i < argc; ++i) {
+		fd = open(argv[i], O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+		if (fd < 0 || fstat(fd, &sb) < 0) {
+			fprintf(stderr, "Could not open %s: %s\n",
+			        argv[i], strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			continue;
+		}
+		dc_note_fs(l, fd, sb.st_dev);
+		if (S_ISDIR(sb.st_mode)) {
+			nr = realloc(l->root, sizeof(*nr) * (l->nroots + 1));
+			if (nr == NULL) {
+				perror("realloc");
+				close(fd);
+				return false;
+			}
+			l->root = nr;
+			l->root[l->nroots++] = fd;
+			dc_walk(l, fd, argv[i], fd, strlen(argv[i]) + 1);
+			continue;
+		} else if (S_ISREG(sb.st_mode) &&
+		    (unsigned long long)sb.st_size >= dc_min_size) {
+			path = strdup(argv[i]);
+			if (path == NULL ||
+			    !dc_add_file(l, path, sb.st_size, -1, 0)) {
+				close(fd);
+				return false;
+			}
+		}
+		close(fd);
 	}
-	memcpy(outmap, inmap, sb.st_size);
-	if (msync(outmap, sb.st_size, MS_ASYNC) < 0) {
-		fprintf(stderr, "msync: %s\n", strerror(errno));
-		goto out6;
+	return true;
+}
+
+/**
+ * Declone the files of @argv (serially, or with dc_nthreads threads). With
+ * -r, the arguments are expanded first, and the durability of all the
+ * copies is taken care of by one syncfs per filesystem at the end.
+ */
+static int dc_run(int argc, const char **argv)
+{
+	struct dc_list l = {};
+	int ret = EXIT_SUCCESS;
+	struct stat sb;
+	size_t i;
+
+	if (dc_recursive) {
+		if (!dc_collect(&l, argc, argv))
+			ret = EXIT_FAILURE;
+	} else {
+		l.file = calloc(argc, sizeof(*l.file));
+		if (argc > 0 && l.file == NULL) {
+			perror("calloc");
+			return EXIT_FAILURE;
+		}
+		for (l.nfiles = 0; l.nfiles < (size_t)argc; ++l.nfiles) {
+			l.file[l.nfiles].path = (char *)argv[l.nfiles];
+			l.file[l.nfiles].root = -1;
+			/* Only -j looks at the size. */
+			if (dc_nthreads > 1 && stat(argv[l.nfiles], &sb) == 0)
+				l.file[l.nfiles].size = sb.st_size;
+		}
 	}
-	if (rename(outname, file) < 0) {
-		fprintf(stderr, "Could not replace %s: %s\n",
-		        file, strerror(errno));
-		goto out6;
-	}
-	printf("* %s\n", file);
- out6:
-	munmap(outmap, sb.st_size);
- out5:
-	close(outfd);
-	unlink(outname);
- out4:
-	HXmc_free(outname);
- out3:
-	free(cont_dir);
- out2:
-	munmap(inmap, sb.st_size);
- out:
-	close(infd);
+	if (ret != EXIT_SUCCESS || l.nfiles == 0)
+		;
+	else if (dc_nthreads > 1)
+		ret = dc_parallel(&l);
+	else
+		for (i = 0; i < l.nfiles; ++i)
+			if (dofile(&l.file[i]) == DC_DONE)
+				printf("* %s\n", l.file[i].path);
+	for (i = 0; i < l.nfs; ++i) {
+		if (syncfs(l.fs[i].fd) < 0) {
+			perror("syncfs");
+			ret = EXIT_FAILURE;
+		}
+		close(l.fs[i].fd);
+	}
+	for (i = 0; i < l.nroots; ++i)
+		close(l.root[i]);
+	if (dc_recursive)
+		for (i = 0; i < l.nfiles; ++i)
+			free(l.file[i].path);
+	free(l.file);
+	free(l.root);
+	free(l.fs);
+	return ret;
 }
 
-int main(int argc, const char **argv)
+static bool dc_get_options(int *argc, const char ***argv)
 {
-	++argv;
-	for (; --argc > 0 && *argv != NULL; ++argv)
-		dofile(*argv);
+	static const struct HXoption options_table[] = {
+		{.sh = 'f', .ln = "force", .type = HXTYPE_NONE, .ptr = &dc_force,
+		 .help = "Declone files even if they share no extents"},
+		{.sh = 'i', .ln = "in-place", .type = HXTYPE_NONE,
+		 .ptr = &dc_inplace,
+		 .help = "Rewrite only the shared ranges, in place"},
+		{.sh = 'j', .type = HXTYPE_UINT, .ptr = &dc_nthreads,
+		 .help = "Declone N files in parallel", .htyp = "N"},
+		{.sh = 'm', .ln = "min-size", .type = HXTYPE_ULLONG,
+		 .ptr = &dc_min_size,
+		 .help = "With -r, only declone files of at least N bytes",
+		 .htyp = "N"},
+		{.sh = 'r', .ln = "recursive", .type = HXTYPE_NONE,
+		 .ptr = &dc_recursive,
+		 .help = "Declone all files in the given directories"},
+		{.sh = 's', .ln = "stream", .type = HXTYPE_NONE, .ptr = &dc_stream,
+		 .help = "Copy in blocks rather than mapping whole files"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	return HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) ==
+	       HXOPT_ERR_SUCCESS;
+}
+
+static int main2(int argc, const char **argv)
+{
+	int ret;
+
+	if (!dc_get_options(&argc, &argv))
+		return EXIT_FAILURE;
+	ret = dc_run(argc - 1, argv + 1);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	printf("%llu bytes rewritten, %llu bytes skipped (not shared)\n",
+	       dc_rewritten, dc_skipped);
 	return EXIT_SUCCESS;
 }
+
+int main(int argc, const char **argv)
+{
+	int ret;
+
+	if ((ret = HX_init()) < 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	ret = main2(argc, argv);
+	HX_exit();
+	return ret;
+}
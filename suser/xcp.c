@@ -7,40 +7,192 @@
  *	(at your option) any later version.
  */
 #define _GNU_SOURCE 1
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <libHX/defs.h>
 #include <libHX/init.h>
+#include <libHX/io.h>
 #include <libHX/option.h>
+#include <libHX/string.h>
 #include "config.h"
+#ifdef HAVE_LINUX_FS_H
+#	include <linux/fs.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#	include <sys/syscall.h>
+#	include <sys/uio.h>
+#	include <linux/io_uring.h>
+#endif
 
 enum {
 	XCP_MMAP,
 	XCP_MMAP2,
 	XCP_SPLICE,
+	XCP_CFR,
+	XCP_REFLINK,
+	XCP_URING,
+};
+
+enum {
+	XCP_CHUNK_SIZE = 64 << 20,
+	XCP_URING_BUF = 1 << 20,
+	XCP_DIRECT_ALIGN = 4096,
+	XCP_READBACK_BUF = 1 << 20,
+	XCP_BATCH_FILES = 64,
+	XCP_BATCH_BYTES = 8 << 20,
+	XCP_SMALL_FILE = 64 << 10,
+};
+
+/**
+ * A file found by -r. Files larger than XCP_CHUNK_SIZE are copied in chunks
+ * by several workers; @chunks counts those not done yet, and whoever
+ * finishes the last one applies the metadata.
+ */
+struct xcp_item {
+	char *path;
+	struct stat sb;
+	unsigned int chunks;
+};
+
+/**
+ * Work for one -r worker: either a batch of small files, which are copied
+ * whole, or one chunk (@off, @len) of a large file.
+ */
+struct xcp_task {
+	struct xcp_task *next;
+	struct xcp_item *item[XCP_BATCH_FILES];
+	unsigned int nitems;
+	off_t off, len, bytes;
+};
+
+/**
+ * State of a -r copy. The walker appends tasks to @head..@tail and
+ * signals @cond; @done is set when the walk has finished. @dirs holds the
+ * directories, whose metadata is set once all files are in place.
+ */
+struct xcp_tree {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int (*copy)(int, int, off_t, off_t);
+	int sroot, droot;
+	struct xcp_task *head, *tail, *batch;
+	struct xcp_item *dirs;
+	size_t ndirs;
+	bool done;
+	unsigned long long files, bytes;
+	unsigned int errors;
+};
+
+/**
+ * CRC32C of one range of the source and of the destination, as raw CRC
+ * registers (initial value 0, no final inversion), which makes them easy to
+ * join into the checksum of the whole file.
+ */
+struct xcp_sum {
+	off_t off, len;
+	uint32_t src, dst;
+};
+
+/**
+ * @chunk:	ranges of the input to copy, cut at XCP_CHUNK_SIZE boundaries
+ * @next:	index of the next chunk to hand out
+ * @failed:	a worker ran into an error, stop handing out chunks
+ */
+struct xcp_pool {
+	pthread_mutex_t lock;
+	int (*copy)(int, int, off_t, off_t);
+	int ifd, ofd;
+	struct xcp_chunk {
+		off_t off, len;
+	} *chunk;
+	size_t nchunks, next;
+	bool failed;
 };
 
-static unsigned int xcp_mode = XCP_MMAP;
+static unsigned int xcp_mode = XCP_MMAP, xcp_jobs, xcp_depth = 8;
+static unsigned int xcp_window = 64;
+static int xcp_direct, xcp_sync, xcp_bench, xcp_auto, xcp_verify;
+static int xcp_recursive;
+static long xcp_pipe_max = 1 << 20;
+static struct xcp_sum *xcp_sums;
+static size_t xcp_nsums;
+static pthread_mutex_t xcp_sum_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t xcp_crc_table[8][256], xcp_x2n_table[32];
+static bool xcp_crc_hw;
+/* For --bench: I/O calls made, and whether a strategy had to fall back. */
+static unsigned long xcp_calls;
+static bool xcp_fellback;
+
+static const struct xcp_strategy {
+	const char *name;
+	unsigned int mode;
+} xcp_strategies[] = {
+	{"mmap", XCP_MMAP},
+	{"mmap2", XCP_MMAP2},
+	{"splice", XCP_SPLICE},
+	{"copy-range", XCP_CFR},
+	{"uring", XCP_URING},
+	{"reflink", XCP_REFLINK},
+};
 
 static bool xcp_get_options(int *argc, const char ***argv)
 {
 	static struct HXoption options_table[] = {
+		{.ln = "auto", .type = HXTYPE_NONE, .ptr = &xcp_auto,
+		 .help = "Use the strategy that --bench found fastest"},
+		{.ln = "bench", .type = HXTYPE_NONE, .ptr = &xcp_bench,
+		 .help = "Time all strategies, using the destination as scratch file"},
+		{.sh = 'c', .ln = "copy-range", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_CFR,
+		 .help = "Use copy_file_range(2)"},
 		{.sh = 'd', .ptr = &xcp_mode,
 		 .type = HXTYPE_VAL, .val = XCP_MMAP2,
 		 .help = "Use mmap(2) for reading and writing"},
+		{.ln = "depth", .type = HXTYPE_UINT, .ptr = &xcp_depth,
+		 .help = "Number of io_uring requests in flight (default: 8)",
+		 .htyp = "N"},
+		{.ln = "direct", .type = HXTYPE_NONE, .ptr = &xcp_direct,
+		 .help = "Bypass the page cache with O_DIRECT (io_uring only)"},
+		{.sh = 'j', .type = HXTYPE_UINT, .ptr = &xcp_jobs,
+		 .help = "Copy chunks of the file with N threads in parallel",
+		 .htyp = "N"},
 		{.sh = 'm', .ln = "mmap", .ptr = &xcp_mode,
 		 .type = HXTYPE_VAL, .val = XCP_MMAP,
 		 .help = "Use mmap(2) for reading, write(2) for writing"},
+		{.sh = 'r', .ln = "recursive", .type = HXTYPE_NONE,
+		 .ptr = &xcp_recursive,
+		 .help = "Copy a directory tree, with -j workers"},
+		{.ln = "reflink", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_REFLINK,
+		 .help = "Share the data blocks (FICLONE), or copy_file_range(2)"},
 		{.sh = 's', .ln = "splice", .ptr = &xcp_mode,
 		 .type = HXTYPE_VAL, .val = XCP_SPLICE,
 		 .help = "Use splice(2) for reading and writing"},
+		{.ln = "sync", .type = HXTYPE_NONE, .ptr = &xcp_sync,
+		 .help = "Pace writeback of the mmap windows with sync_file_range(2)"},
+		{.sh = 'u', .ln = "uring", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_URING,
+		 .help = "Use io_uring with several reads/writes in flight"},
+		{.sh = 'V', .ln = "verify", .type = HXTYPE_NONE, .ptr = &xcp_verify,
+		 .help = "Compare CRC32C checksums of the source and the copy"},
+		{.ln = "window", .type = HXTYPE_UINT, .ptr = &xcp_window,
+		 .help = "Size of the mmap windows in MB (default: 64, 0: whole file)",
+		 .htyp = "N"},
 		HXOPT_AUTOHELP,
 		HXOPT_TABLEEND,
 	};
@@ -48,149 +200,1877 @@ static bool xcp_get_options(int *argc, const char ***argv)
 	       HXOPT_ERR_SUCCESS;
 }
 
-#ifdef HAVE_SPLICE
-static int xcp_splice(const char *input, const char *output)
+/**
+ * Open @input for reading and @output for writing, as all the strategies
+ * do. Returns false (after reporting the problem) if that did not work.
+ */
+static bool xcp_open(const char *input, const char *output, int *ifd,
+    int *ofd, struct stat *isb)
 {
-	off_t ioff = 0, ooff = 0;
-	int ifd, pfd[2], ofd;
-	struct stat isb;
-	long ret;
-
-	ifd = open(input, O_RDONLY);
-	if (ifd < 0) {
+	*ifd = open(input, O_RDONLY);
+	if (*ifd < 0) {
 		fprintf(stderr, "open(\"%s\"): %s\n", input, strerror(errno));
-		return EXIT_FAILURE;
+		return false;
 	}
-
-	ofd = open(output, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (ofd < 0) {
+	if (fstat(*ifd, isb) < 0) {
+		perror("fstat");
+		close(*ifd);
+		return false;
+	}
+	*ofd = open(output, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (*ofd < 0) {
 		fprintf(stderr, "open(\"%s\"): %s\n", output, strerror(errno));
-		return EXIT_FAILURE;
+		close(*ifd);
+		return false;
 	}
+	return true;
+}
 
-	if (pipe(pfd) < 0) {
-		perror("pfd");
-		return EXIT_FAILURE;
+static bool xcp_unsupported(int err)
+{
+	return err == ENOSYS || err == EXDEV || err == EINVAL ||
+	       err == EOPNOTSUPP || err == ENOTTY || err == EBADF;
+}
+
+static void xcp_tally(void)
+{
+	__atomic_fetch_add(&xcp_calls, 1, __ATOMIC_RELAXED);
+}
+
+#define XCP_CRC32C_POLY 0x82f63b78U
+
+/**
+ * Multiply @a and @b modulo the CRC32C polynomial (bit-reversed, so x^0 is
+ * the top bit).
+ */
+static uint32_t xcp_crc_mult(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ XCP_CRC32C_POLY : b >> 1;
 	}
+	return p;
+}
 
-	if (fstat(ifd, &isb) < 0) {
-		perror("fstat");
-		return EXIT_FAILURE;
+/**
+ * Advance the raw CRC register @crc over @len zero bytes, i.e. multiply by
+ * x^(8*@len), built from the x^(2^k) powers in xcp_x2n_table.
+ */
+static uint32_t xcp_crc_shift(uint32_t crc, uint64_t len)
+{
+	uint32_t p = 1U << 31;
+	unsigned int k = 3;
+
+	for (; len != 0; len >>= 1, ++k)
+		if (len & 1)
+			p = xcp_crc_mult(xcp_x2n_table[k & 31], p);
+	return xcp_crc_mult(p, crc);
+}
+
+static void xcp_crc_init(void)
+{
+	uint32_t c, p = 1U << 30;
+	unsigned int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		for (c = i, k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ XCP_CRC32C_POLY : c >> 1;
+		xcp_crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; ++i)
+		for (k = 1; k < 8; ++k)
+			xcp_crc_table[k][i] = (xcp_crc_table[k-1][i] >> 8) ^
+				xcp_crc_table[0][xcp_crc_table[k-1][i] & 0xff];
+	xcp_x2n_table[0] = p;
+	for (i = 1; i < 32; ++i)
+		xcp_x2n_table[i] = p = xcp_crc_mult(p, p);
+#ifdef __x86_64__
+	xcp_crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2"))) static uint32_t
+xcp_crc_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc, w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, sizeof(w));
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	for (crc = c; len > 0; --len)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
+/**
+ * Update the raw CRC32C register with @len bytes: with the SSE4.2 crc32
+ * instruction where the CPU has it, otherwise slicing-by-8.
+ */
+static uint32_t xcp_crc(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const uint32_t (*t)[256] = xcp_crc_table;
+
+#ifdef __x86_64__
+	if (xcp_crc_hw)
+		return xcp_crc_sse42(crc, p, len);
+#endif
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; len >= 8; p += 8, len -= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo ^= crc;
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+		      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+		      t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+	}
+#endif
+	for (; len > 0; --len)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+static bool xcp_add_sum(off_t off, off_t len, uint32_t src, uint32_t dst)
+{
+	struct xcp_sum *ns;
+	bool ret = true;
+
+	pthread_mutex_lock(&xcp_sum_lock);
+	if ((xcp_nsums & (xcp_nsums - 1)) == 0) {
+		ns = realloc(xcp_sums, sizeof(*ns) * (xcp_nsums * 2 + 1));
+		if (ns == NULL)
+			ret = false;
+		else
+			xcp_sums = ns;
+	}
+	if (ret) {
+		ns = &xcp_sums[xcp_nsums++];
+		ns->off = off;
+		ns->len = len;
+		ns->src = src;
+		ns->dst = dst;
 	}
+	pthread_mutex_unlock(&xcp_sum_lock);
+	if (!ret)
+		perror("realloc");
+	return ret;
+}
 
-	while (ioff != isb.st_size) {
-		ret = splice(ifd, &ioff, pfd[1], NULL, isb.st_size, 0);
+/**
+ * Checksum @len bytes at @off of @fd by reading them, for the strategies
+ * where the data does not pass through our address space.
+ */
+static bool xcp_crc_fd(int fd, off_t off, off_t len, uint32_t *crc,
+    char *buf)
+{
+	ssize_t ret;
+
+	for (*crc = 0; len > 0; off += ret, len -= ret) {
+		ret = pread(fd, buf, len < XCP_READBACK_BUF ? len :
+		      XCP_READBACK_BUF, off);
 		if (ret < 0) {
+			perror("read");
+			return false;
+		} else if (ret == 0) {
+			fprintf(stderr, "File got shorter during the copy\n");
+			return false;
+		}
+		*crc = xcp_crc(*crc, buf, ret);
+	}
+	return true;
+}
+
+/*
+ * The strategies copy the range @off..@off+@len from @ifd to the same
+ * offset in @ofd. They return 1 when done, -1 on error (which has been
+ * reported), and 0 if the mechanism is not available for this pair of files
+ * and nothing was written, so that the caller can fall back to another one.
+ */
+#ifdef HAVE_SPLICE
+/**
+ * Give the pipe the largest buffer allowed, so that one splice moves up to
+ * that much instead of 64 KB. Unprivileged users can be held below
+ * pipe-max-size by pipe-user-pages-soft, so try smaller sizes too.
+ */
+static void xcp_pipe_grow(int fd, off_t len)
+{
+	long size = xcp_pipe_max;
+
+	for (; size > 65536; size /= 2)
+		if (size / 2 < len && fcntl(fd, F_SETPIPE_SZ, size) >= 0)
+			break;
+}
+
+/**
+ * Move @len bytes at @off of @ifd to @ofd, at @*ooff or, for streams
+ * (@ooff == NULL), at the current position. If @ofd is a pipe itself, the
+ * data is spliced into it directly; otherwise through a pipe of our own.
+ */
+static int xcp_splice_to(int ifd, off_t off, off_t len, int ofd,
+    loff_t *ooff)
+{
+	loff_t ioff = off, end = off + len;
+	int pfd[2] = {-1, -1}, ret = 1, wfd = ofd;
+	struct stat sb;
+	ssize_t in, out;
+
+	if (ooff != NULL || fstat(ofd, &sb) < 0 || !S_ISFIFO(sb.st_mode)) {
+		if (pipe(pfd) < 0) {
+			perror("pipe");
+			return -1;
+		}
+		wfd = pfd[1];
+	}
+	xcp_pipe_grow(wfd, len);
+	while (ioff < end) {
+		xcp_tally();
+		in = splice(ifd, &ioff, wfd, NULL, end - ioff,
+		     SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0 && ioff == off && xcp_unsupported(errno)) {
+			ret = 0;
+			break;
+		} else if (in < 0) {
 			perror("splice-in");
-			return EXIT_FAILURE;
+			ret = -1;
+			break;
+		} else if (in == 0) {
+			/* Source got shorter. */
+			break;
 		}
-		ret = splice(pfd[0], NULL, ofd, &ooff, ret, 0);
-		if (ret < 0) {
-			perror("splice-out");
-			return EXIT_FAILURE;
+		if (wfd == ofd)
+			continue;
+		/* The other side may take less than what is in the pipe. */
+		for (; in > 0; in -= out) {
+			xcp_tally();
+			out = splice(pfd[0], NULL, ofd, ooff, in, SPLICE_F_MOVE |
+			      (ioff < end ? SPLICE_F_MORE : 0));
+			if (out < 0 && ioff - in == off && xcp_unsupported(errno)) {
+				ret = 0;
+				goto out;
+			} else if (out < 0) {
+				perror("splice-out");
+				ret = -1;
+				goto out;
+			}
 		}
 	}
+ out:
+	if (pfd[0] >= 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+	}
+	return ret;
+}
+
+static int xcp_splice(int ifd, int ofd, off_t off, off_t len)
+{
+	loff_t ooff = off;
 
-	return EXIT_SUCCESS;
+	return xcp_splice_to(ifd, off, len, ofd, &ooff);
 }
 #else
-static int xcp_splice(const char *input, const char *output)
+static int xcp_splice_to(int ifd, off_t off, off_t len, int ofd,
+    loff_t *ooff)
+{
+	return 0;
+}
+
+static int xcp_splice(int ifd, int ofd, off_t off, off_t len)
 {
 	fprintf(stderr, "ERROR: xcp was built without splice support\n");
-	return EXIT_FAILURE;
+	return -1;
 }
 #endif
 
-static int xcp_mmap(const char *input, const char *output)
+/**
+ * Map @len bytes at @off. mmap needs a page-aligned offset; @delta is set
+ * to where @off lies within the mapping.
+ */
+static void *xcp_map(int fd, int prot, off_t off, off_t len, size_t *delta)
 {
-	struct stat isb;
-	int ifd, ofd;
+	off_t moff = off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
 	void *area;
 
-	ifd = open(input, O_RDONLY);
-	if (ifd < 0) {
-		fprintf(stderr, "open(\"%s\"): %s\n", input, strerror(errno));
-		return EXIT_FAILURE;
+	*delta = off - moff;
+	xcp_tally();
+	area = mmap(NULL, len + *delta, prot, MAP_SHARED, fd, moff);
+	return area == MAP_FAILED ? NULL : area;
+}
+
+static int xcp_mmap_window(int ifd, int ofd, off_t off, off_t len)
+{
+	size_t delta;
+	ssize_t ret;
+	off_t done;
+	char *area;
+
+	area = xcp_map(ifd, PROT_READ, off, len, &delta);
+	if (area == NULL) {
+		perror("mmap");
+		return -1;
 	}
+	madvise(area, len + delta, MADV_SEQUENTIAL);
 
-	ofd = open(output, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (ofd < 0) {
-		fprintf(stderr, "open(\"%s\"): %s\n", output, strerror(errno));
-		return EXIT_FAILURE;
+	for (done = 0; done < len; done += ret) {
+		xcp_tally();
+		ret = pwrite(ofd, area + delta + done, len - done, off + done);
+		if (ret < 0) {
+			perror("write");
+			munmap(area, len + delta);
+			return -1;
+		}
 	}
+	if (xcp_verify) {
+		/* The copy is still in the page cache. */
+		char *buf = malloc(XCP_READBACK_BUF);
+		uint32_t dst;
+		bool ok = buf != NULL && xcp_crc_fd(ofd, off, len, &dst, buf) &&
+		          xcp_add_sum(off, len, xcp_crc(0, area + delta, len), dst);
 
-	if (fstat(ifd, &isb) < 0) {
-		perror("fstat");
-		return EXIT_FAILURE;
+		free(buf);
+		if (!ok) {
+			munmap(area, len + delta);
+			return -1;
+		}
 	}
 
-	area = mmap(NULL, isb.st_size, PROT_READ, MAP_SHARED, ifd, 0);
-	if (area == (void *)-1) {
+	munmap(area, len + delta);
+	return 1;
+}
+
+static int xcp_mmap2_window(int ifd, int ofd, off_t off, off_t len)
+{
+	size_t idelta, odelta;
+
+	void *iarea = xcp_map(ifd, PROT_READ, off, len, &idelta);
+	if (iarea == NULL) {
 		perror("mmap");
+		return -1;
+	}
+	void *oarea = xcp_map(ofd, PROT_READ | PROT_WRITE, off, len, &odelta);
+	if (oarea == NULL) {
+		perror("mmap - 2");
+		munmap(iarea, len + idelta);
+		return -1;
+	}
+	madvise(iarea, len + idelta, MADV_SEQUENTIAL);
+	madvise(oarea, len + odelta, MADV_SEQUENTIAL);
+	memcpy(oarea + odelta, iarea + idelta, len);
+	if (xcp_verify && !xcp_add_sum(off, len, xcp_crc(0, iarea + idelta, len),
+	    xcp_crc(0, oarea + odelta, len))) {
+		munmap(iarea, len + idelta);
+		munmap(oarea, len + odelta);
+		return -1;
+	}
+	munmap(iarea, len + idelta);
+	munmap(oarea, len + odelta);
+	return 1;
+}
+
+#ifdef HAVE_SYNC_FILE_RANGE
+/**
+ * Wait for the writeback of a window of the output, which was started
+ * earlier, and drop it from the page cache, which only works on clean pages.
+ */
+static void xcp_sync_behind(int ofd, off_t off, off_t len)
+{
+	sync_file_range(ofd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+		SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(ofd, off, len, POSIX_FADV_DONTNEED);
+}
+#endif
+
+/**
+ * Copy the range with @copy in windows of xcp_window megabytes (at window
+ * boundaries), so that only one window is mapped at a time, and drop each
+ * window of the input from the page cache behind us. With --sync, the
+ * writeback of each window is started right away, and the previous one is
+ * waited for and dropped, which keeps the amount of dirty and cached output
+ * to two windows.
+ */
+static int xcp_windowed(int ifd, int ofd, off_t off, off_t len,
+    int (*copy)(int, int, off_t, off_t))
+{
+	off_t win = (off_t)xcp_window << 20, end = off + len, next;
+	off_t poff = 0, plen = 0;
+	int ret;
+
+	if (win == 0)
+		return copy(ifd, ofd, off, len);
+	for (; off < end; off = next) {
+		next = (off / win + 1) * win;
+		if (next > end)
+			next = end;
+		ret = copy(ifd, ofd, off, next - off);
+		if (ret <= 0)
+			return ret;
+		posix_fadvise(ifd, off, next - off, POSIX_FADV_DONTNEED);
+#ifdef HAVE_SYNC_FILE_RANGE
+		if (!xcp_sync)
+			continue;
+		sync_file_range(ofd, off, next - off, SYNC_FILE_RANGE_WRITE);
+		if (plen > 0)
+			xcp_sync_behind(ofd, poff, plen);
+		poff = off;
+		plen = next - off;
+#endif
+	}
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (plen > 0)
+		xcp_sync_behind(ofd, poff, plen);
+#endif
+	return 1;
+}
+
+static int xcp_mmap(int ifd, int ofd, off_t off, off_t len)
+{
+	return xcp_windowed(ifd, ofd, off, len, xcp_mmap_window);
+}
+
+static int xcp_mmap2(int ifd, int ofd, off_t off, off_t len)
+{
+	return xcp_windowed(ifd, ofd, off, len, xcp_mmap2_window);
+}
+
+/**
+ * Let the kernel do the copy, which may be done in-kernel without going
+ * through page cache mappings, or even on the server side for NFS/CIFS.
+ */
+static int xcp_cfr(int ifd, int ofd, off_t off, off_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t ioff = off, ooff = off, end = off + len;
+	ssize_t ret;
+
+	while (ioff < end) {
+		xcp_tally();
+		ret = copy_file_range(ifd, &ioff, ofd, &ooff,
+		      end - ioff > (1 << 30) ? (1 << 30) : end - ioff, 0);
+		if (ret < 0 && ioff == off && xcp_unsupported(errno))
+			return 0;
+		if (ret < 0) {
+			perror("copy_file_range");
+			return -1;
+		}
+		if (ret == 0)
+			/* Source got shorter. */
+			break;
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+/**
+ * The rings shared with the kernel, set up with the raw syscalls so that no
+ * liburing is needed. @pending counts the SQEs not yet handed to the kernel.
+ */
+struct xcp_ring {
+	int fd;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqe_len;
+	unsigned int pending;
+};
+
+/**
+ * One buffer of the pipeline. It is read into from @off (up to @len bytes,
+ * of which @got arrived), then written out (@done bytes so far); a short
+ * read continues with the rest of the range afterwards.
+ */
+struct xcp_slot {
+	off_t off;
+	size_t len, got, done;
+	bool writing;
+};
+
+static void xcp_ring_exit(struct xcp_ring *r)
+{
+	if (r->sqe != MAP_FAILED)
+		munmap(r->sqe, r->sqe_len);
+	if (r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+	if (r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_len);
+	close(r->fd);
+}
+
+static int xcp_ring_init(struct xcp_ring *r, unsigned int depth)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->sq_map = r->cq_map = r->sqe = MAP_FAILED;
+	r->pending = 0;
+	r->fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (r->fd < 0)
+		return -errno;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+	r->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+	            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto out;
+	r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map :
+	            mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+	            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_map == MAP_FAILED)
+		goto out;
+	r->sqe = mmap(NULL, r->sqe_len, PROT_READ | PROT_WRITE,
+	         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqe == MAP_FAILED)
+		goto out;
+	r->sq_tail  = r->sq_map + p.sq_off.tail;
+	r->sq_mask  = r->sq_map + p.sq_off.ring_mask;
+	r->sq_array = r->sq_map + p.sq_off.array;
+	r->cq_head  = r->cq_map + p.cq_off.head;
+	r->cq_tail  = r->cq_map + p.cq_off.tail;
+	r->cq_mask  = r->cq_map + p.cq_off.ring_mask;
+	r->cqe      = r->cq_map + p.cq_off.cqes;
+	return 0;
+ out:
+	xcp_ring_exit(r);
+	return -errno;
+}
+
+/**
+ * Tell whether the kernel has the plain IORING_OP_READ/WRITE (5.6), needed
+ * when the buffers could not be registered. 5.1 to 5.5 set up rings all
+ * right, but fail every such request with EINVAL; they do not know
+ * IORING_REGISTER_PROBE either.
+ */
+static bool xcp_ring_plain(const struct xcp_ring *r)
+{
+	unsigned int nops = IORING_OP_WRITE + 1;
+	struct io_uring_probe *probe;
+	bool ok;
+
+	probe = calloc(1, sizeof(*probe) + nops * sizeof(probe->ops[0]));
+	if (probe == NULL)
+		return false;
+	ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+	     probe, nops) == 0 && probe->ops_len > IORING_OP_WRITE &&
+	     (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	     (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+/**
+ * Queue the next read or write of slot @idx. O_DIRECT (@dfd) is used when
+ * the offset, length and buffer address all are suitably aligned, which is
+ * everything but the tail of the file and the rest of a short transfer;
+ * those go through the page cache (@fd).
+ */
+static void xcp_ring_queue(struct xcp_ring *r, struct xcp_slot *s,
+    unsigned int idx, char *buf, bool fixed, int fd, int dfd)
+{
+	unsigned int tail = *r->sq_tail, i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqe[i];
+	off_t off = s->writing ? s->off + s->done : s->off;
+	size_t len = s->writing ? s->got - s->done : s->len;
+	char *addr = s->writing ? buf + s->done : buf;
+
+	if (dfd >= 0 && (off | len | (unsigned long)addr) %
+	    XCP_DIRECT_ALIGN == 0)
+		fd = dfd;
+	memset(sqe, 0, sizeof(*sqe));
+	if (s->writing)
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	else
+		sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd        = fd;
+	sqe->off       = off;
+	sqe->addr      = (unsigned long)addr;
+	sqe->len       = len;
+	sqe->buf_index = fixed ? idx : 0;
+	sqe->user_data = idx;
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++r->pending;
+}
+
+/**
+ * Digest a completion. Returns true if the slot has been queued again,
+ * false if it became free. Errors are reported and latched in @*ret; after
+ * that, the remaining requests are only drained.
+ */
+static bool xcp_ring_done(struct xcp_slot *s, int res, int *ret)
+{
+	if (*ret < 0) {
+		return false;
+	} else if (res < 0) {
+		fprintf(stderr, "io_uring %s: %s\n",
+		        s->writing ? "write" : "read", strerror(-res));
+		*ret = -1;
+		return false;
+	} else if (!s->writing) {
+		if (res == 0)
+			/* Source got shorter. */
+			return false;
+		s->got = res;
+		s->done = 0;
+		s->writing = true;
+		return true;
+	} else if (res == 0) {
+		fprintf(stderr, "io_uring write: no progress\n");
+		*ret = -1;
+		return false;
+	}
+	s->done += res;
+	if (s->done < s->got)
+		return true;
+	if (s->got == s->len)
+		return false;
+	s->off += s->got;
+	s->len -= s->got;
+	s->writing = false;
+	return true;
+}
+
+/**
+ * Open another descriptor for the file behind @fd with O_DIRECT, so that
+ * the original one keeps working for the unaligned parts.
+ */
+static int xcp_reopen_direct(int fd, int flags)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, flags | O_DIRECT);
+}
+
+/**
+ * Keep xcp_depth reads and writes in flight, so that reading the next
+ * buffers overlaps with writing the previous ones. The buffers are
+ * registered with the kernel, which saves pinning the pages for every
+ * request. If io_uring cannot be set up (old kernel, disabled by sysctl or
+ * seccomp), or the buffers cannot be registered on a kernel that lacks the
+ * plain read/write opcodes, returns 0 for the caller to fall back.
+ */
+static int xcp_uring(int ifd, int ofd, off_t off, off_t len)
+{
+	unsigned int depth = xcp_depth != 0 ? xcp_depth : 1, busy = 0, i;
+	unsigned int head, tail;
+	off_t next = off, end = off + len;
+	int dfd_in = -1, dfd_out = -1, ret = 1, n;
+	struct xcp_ring ring;
+	struct xcp_slot *slot;
+	struct iovec *iov;
+	bool fixed;
+	char *buf;
+
+	if (depth > (len + XCP_URING_BUF - 1) / XCP_URING_BUF)
+		depth = (len + XCP_URING_BUF - 1) / XCP_URING_BUF;
+	if (xcp_ring_init(&ring, depth) < 0)
+		return 0;
+	slot = calloc(depth, sizeof(*slot));
+	iov  = calloc(depth, sizeof(*iov));
+	if (slot == NULL || iov == NULL ||
+	    posix_memalign((void **)&buf, XCP_DIRECT_ALIGN,
+	    (size_t)depth * XCP_URING_BUF) != 0) {
+		perror("malloc");
+		free(slot);
+		free(iov);
+		xcp_ring_exit(&ring);
+		return -1;
+	}
+	for (i = 0; i < depth; ++i) {
+		iov[i].iov_base = buf + (size_t)i * XCP_URING_BUF;
+		iov[i].iov_len  = XCP_URING_BUF;
+	}
+	/* Can fail with a low RLIMIT_MEMLOCK, the plain opcodes still work. */
+	fixed = syscall(__NR_io_uring_register, ring.fd,
+	        IORING_REGISTER_BUFFERS, iov, depth) == 0;
+	if (!fixed && !xcp_ring_plain(&ring)) {
+		xcp_ring_exit(&ring);
+		free(buf);
+		free(iov);
+		free(slot);
+		return 0;
+	}
+	if (xcp_direct) {
+		dfd_in  = xcp_reopen_direct(ifd, O_RDONLY);
+		dfd_out = xcp_reopen_direct(ofd, O_WRONLY);
+	}
+
+	while (true) {
+		for (i = 0; ret > 0 && next < end && i < depth; ++i) {
+			struct xcp_slot *s = &slot[i];
+
+			if (s->len != 0)
+				continue;
+			s->off = next;
+			s->len = end - next < XCP_URING_BUF ? end - next :
+			         XCP_URING_BUF;
+			s->writing = false;
+			next += s->len;
+			xcp_ring_queue(&ring, s, i, iov[i].iov_base, fixed,
+				ifd, dfd_in);
+			++busy;
+		}
+		if (busy == 0)
+			break;
+		xcp_tally();
+		n = syscall(__NR_io_uring_enter, ring.fd, ring.pending, 1,
+		        IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			/*
+			 * Closing the ring cancels what is still in flight,
+			 * but the teardown is asynchronous, so the kernel may
+			 * write to @buf a while longer: leak just that.
+			 */
+			perror("io_uring_enter");
+			buf = NULL;
+			ret = -1;
+			break;
+		}
+		ring.pending -= n;
+
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			const struct io_uring_cqe *cqe =
+				&ring.cqe[head & *ring.cq_mask];
+			struct xcp_slot *s = &slot[cqe->user_data];
+
+			if (xcp_ring_done(s, cqe->res, &ret)) {
+				xcp_ring_queue(&ring, s, cqe->user_data,
+					iov[cqe->user_data].iov_base, fixed,
+					s->writing ? ofd : ifd,
+					s->writing ? dfd_out : dfd_in);
+			} else {
+				s->len = 0;
+				--busy;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (dfd_in >= 0)
+		close(dfd_in);
+	if (dfd_out >= 0)
+		close(dfd_out);
+	xcp_ring_exit(&ring);
+	free(buf);
+	free(iov);
+	free(slot);
+	return ret;
+}
+#else
+static int xcp_uring(int ifd, int ofd, off_t off, off_t len)
+{
+	return 0;
+}
+#endif
+
+/**
+ * Make the output share the input's data blocks (btrfs, XFS, OCFS2), which
+ * takes no time and no space until either file is modified. This also keeps
+ * holes.
+ */
+static int xcp_reflink(int ifd, int ofd)
+{
+#ifdef FICLONE
+	if (ioctl(ofd, FICLONE, ifd) == 0)
+		return 1;
+	if (xcp_unsupported(errno))
+		return 0;
+	perror("ioctl FICLONE");
+	return -1;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Find the next data extent at or after @*end, and store it in
+ * @*start..@*end. Filesystems without hole support report everything as
+ * data, as does the fallback for kernels without SEEK_DATA.
+ */
+static bool xcp_next_data(int fd, off_t size, off_t *start, off_t *end)
+{
+	off_t data, hole;
+
+	if (*end >= size)
+		return false;
+	data = lseek(fd, *end, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)
+		return false;
+	if (data < 0) {
+		*start = *end;
+		*end = size;
+		return true;
+	}
+	hole = lseek(fd, data, SEEK_HOLE);
+	if (hole < 0 || hole > size)
+		hole = size;
+	*start = data;
+	*end = hole;
+	return data < size;
+}
+
+static void *xcp_worker(void *arg)
+{
+	struct xcp_pool *pool = arg;
+	struct xcp_chunk *c;
+	int ret;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->failed || pool->next == pool->nchunks) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		c = &pool->chunk[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = pool->copy(pool->ifd, pool->ofd, c->off, c->len);
+		if (ret == 0) {
+			__atomic_store_n(&xcp_fellback, true, __ATOMIC_RELAXED);
+			ret = xcp_mmap(pool->ifd, pool->ofd, c->off, c->len);
+		}
+		if (ret < 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->failed = true;
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static bool xcp_add_chunk(struct xcp_pool *pool, off_t off, off_t len)
+{
+	struct xcp_chunk *nc;
+
+	if ((pool->nchunks & (pool->nchunks - 1)) == 0) {
+		nc = realloc(pool->chunk, sizeof(*nc) * (pool->nchunks * 2 + 1));
+		if (nc == NULL)
+			return false;
+		pool->chunk = nc;
+	}
+	pool->chunk[pool->nchunks].off = off;
+	pool->chunk[pool->nchunks++].len = len;
+	return true;
+}
+
+/**
+ * Copy the data extents with xcp_jobs threads. The extents are preallocated
+ * in the output, so that the concurrent writers do not fragment it, and
+ * split into chunks which are handed out to the threads in order.
+ */
+static int xcp_parallel(int ifd, int ofd, const struct stat *isb,
+    int (*copy)(int, int, off_t, off_t))
+{
+	struct xcp_pool pool = {.copy = copy, .ifd = ifd, .ofd = ofd};
+	off_t start = 0, end = 0, off, next;
+	unsigned int nthr = 0, i;
+	pthread_t *thr;
+	int ret = 0;
+
+	while (xcp_next_data(ifd, isb->st_size, &start, &end)) {
+		fallocate(ofd, 0, start, end - start);
+		for (off = start; off < end; off = next) {
+			next = (off / XCP_CHUNK_SIZE + 1) * XCP_CHUNK_SIZE;
+			if (next > end)
+				next = end;
+			if (!xcp_add_chunk(&pool, off, next - off)) {
+				perror("realloc");
+				free(pool.chunk);
+				return -1;
+			}
+		}
+	}
+	thr = calloc(xcp_jobs, sizeof(*thr));
+	if (thr == NULL) {
+		perror("calloc");
+		free(pool.chunk);
+		return -1;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	for (; nthr < xcp_jobs && nthr < pool.nchunks; ++nthr) {
+		ret = pthread_create(&thr[nthr], NULL, xcp_worker, &pool);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			pthread_mutex_lock(&pool.lock);
+			pool.failed = true;
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+	}
+	for (i = 0; i < nthr; ++i)
+		pthread_join(thr[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	free(thr);
+	free(pool.chunk);
+	return pool.failed ? -1 : 1;
+}
+
+static int xcp_sum_cmp(const void *pa, const void *pb)
+{
+	const struct xcp_sum *a = pa, *b = pb;
+
+	return a->off < b->off ? -1 : a->off > b->off;
+}
+
+/**
+ * Read back the data extents of both files and checksum them, for the
+ * zero-copy strategies.
+ */
+static bool xcp_readback(int ifd, int ofd, off_t size)
+{
+	off_t start = 0, end = 0;
+	uint32_t src, dst;
+	char *buf = malloc(XCP_READBACK_BUF);
+	bool ok = buf != NULL;
+
+	if (buf == NULL)
+		perror("malloc");
+	while (ok && xcp_next_data(ifd, size, &start, &end))
+		ok = xcp_crc_fd(ifd, start, end - start, &src, buf) &&
+		     xcp_crc_fd(ofd, start, end - start, &dst, buf) &&
+		     xcp_add_sum(start, end - start, src, dst);
+	free(buf);
+	return ok;
+}
+
+/**
+ * Join the checksums of the ranges, and of the holes between them, into the
+ * CRC32C of the whole files, and report them. Returns false on a mismatch.
+ */
+static bool xcp_check(const char *input, const char *output, off_t size)
+{
+	uint32_t src = 0, dst = 0, pre;
+	off_t pos = 0;
+	size_t i;
+
+	qsort(xcp_sums, xcp_nsums, sizeof(*xcp_sums), xcp_sum_cmp);
+	for (i = 0; i < xcp_nsums; ++i) {
+		const struct xcp_sum *s = &xcp_sums[i];
+
+		src = xcp_crc_shift(src, s->off + s->len - pos) ^ s->src;
+		dst = xcp_crc_shift(dst, s->off + s->len - pos) ^ s->dst;
+		pos = s->off + s->len;
+	}
+	src = xcp_crc_shift(src, size - pos);
+	dst = xcp_crc_shift(dst, size - pos);
+	/* Turn the raw registers into the standard CRC32C. */
+	pre = xcp_crc_shift(~0U, size) ^ ~0U;
+	src ^= pre;
+	dst ^= pre;
+	free(xcp_sums);
+	xcp_sums = NULL;
+	xcp_nsums = 0;
+	if (!xcp_bench) {
+		printf("%08x  %s\n", src, input);
+		printf("%08x  %s\n", dst, output);
+	}
+	if (src != dst)
+		fprintf(stderr, "%s and %s differ!\n", input, output);
+	return src == dst;
+}
+
+/* The range strategy for xcp_mode; reflinks fall back to copy_file_range. */
+static int (*xcp_select(void))(int, int, off_t, off_t)
+{
+	return xcp_mode == XCP_SPLICE ? xcp_splice :
+	       xcp_mode == XCP_URING ? xcp_uring :
+	       xcp_mode == XCP_MMAP2 ? xcp_mmap2 :
+	       xcp_mode == XCP_MMAP ? xcp_mmap : xcp_cfr;
+}
+
+/**
+ * Copy @input to @output with the selected strategy. Only the data extents
+ * of the input are copied; the output is sized with ftruncate first, so the
+ * holes between them remain holes.
+ */
+static int xcp_copy(const char *input, const char *output)
+{
+	int (*copy)(int, int, off_t, off_t);
+	struct timespec t_start, t_stop;
+	off_t start = 0, end = 0;
+	struct stat isb;
+	int ifd, ofd, ret = 0;
+	double secs;
+
+	if (!xcp_open(input, output, &ifd, &ofd, &isb))
 		return EXIT_FAILURE;
+	xcp_fellback = false;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	if (xcp_mode == XCP_REFLINK) {
+		ret = xcp_reflink(ifd, ofd);
+		xcp_fellback = ret == 0;
+	}
+	if (ret == 0 && ftruncate(ofd, isb.st_size) != 0) {
+		perror("ftruncate");
+		ret = -1;
+	}
+	copy = xcp_select();
+	if (ret == 0 && xcp_jobs > 1) {
+		ret = xcp_parallel(ifd, ofd, &isb, copy);
+		clock_gettime(CLOCK_MONOTONIC, &t_stop);
+		secs = t_stop.tv_sec - t_start.tv_sec +
+		       (t_stop.tv_nsec - t_start.tv_nsec) / 1e9;
+		if (ret > 0 && !xcp_bench)
+			printf("%llu bytes in %.3f s (%.1f MB/s) with %u threads\n",
+			       (unsigned long long)isb.st_size, secs,
+			       secs > 0 ? isb.st_size / secs / 1e6 : 0, xcp_jobs);
+	}
+	while (ret == 0 && xcp_next_data(ifd, isb.st_size, &start, &end)) {
+		ret = copy(ifd, ofd, start, end - start);
+		if (ret == 0) {
+			/* Fall back, and retry this extent. */
+			xcp_fellback = true;
+			copy = xcp_mmap;
+			ret = copy(ifd, ofd, start, end - start);
+		}
+		if (ret > 0)
+			ret = 0;
+	}
+	if (ret >= 0 && xcp_verify) {
+		/*
+		 * The mmap strategies checksum the data while they have it
+		 * mapped, everything else (or a mix after a fallback) is
+		 * read back.
+		 */
+		if ((copy != xcp_mmap && copy != xcp_mmap2) || xcp_fellback) {
+			free(xcp_sums);
+			xcp_sums = NULL;
+			xcp_nsums = 0;
+			if (!xcp_readback(ifd, ofd, isb.st_size))
+				ret = -1;
+		}
+		if (ret >= 0 && !xcp_check(input, output, isb.st_size))
+			ret = -1;
+	}
+	close(ifd);
+	close(ofd);
+	return ret >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * The benchmark results are kept per pair of filesystems: the types of the
+ * source's and the destination directory's filesystem, and whether they are
+ * the same mount (where copy_file_range and reflinks work), in @key.
+ */
+static bool xcp_fs_pair(const char *input, const char *output, char *key,
+    size_t ksize)
+{
+	struct statfs isf, osf;
+	struct stat isb, osb;
+	char *dir = HX_dirname(output);
+	bool ok;
+
+	ok = dir != NULL && statfs(input, &isf) == 0 &&
+	     stat(input, &isb) == 0 && statfs(dir, &osf) == 0 &&
+	     stat(dir, &osb) == 0;
+	free(dir);
+	if (ok)
+		snprintf(key, ksize, "%lx %lx %d", (unsigned long)isf.f_type,
+		         (unsigned long)osf.f_type, isb.st_dev == osb.st_dev);
+	return ok;
+}
+
+static hxmc_t *xcp_cache_path(void)
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+	hxmc_t *path;
+
+	if (dir != NULL && *dir != '\0') {
+		path = HXmc_strinit(dir);
+	} else {
+		dir = getenv("HOME");
+		if (dir == NULL || *dir == '\0')
+			return NULL;
+		path = HXmc_strinit(dir);
+		HXmc_strcat(&path, "/.cache");
+	}
+	HXmc_strcat(&path, "/hxtools/xcp-bench");
+	return path;
+}
+
+/**
+ * Find the strategy recorded for @key. The cache file has one line per
+ * filesystem pair, the key followed by the name of the fastest strategy.
+ */
+static const struct xcp_strategy *xcp_cache_lookup(const char *key)
+{
+	const struct xcp_strategy *ret = NULL;
+	hxmc_t *path = xcp_cache_path(), *line = NULL;
+	size_t klen = strlen(key), i;
+	FILE *fp;
+
+	if (path == NULL)
+		return NULL;
+	fp = fopen(path, "r");
+	HXmc_free(path);
+	if (fp == NULL)
+		return NULL;
+	while (ret == NULL && HX_getl(&line, fp) != NULL) {
+		HX_chomp(line);
+		if (strncmp(line, key, klen) != 0 || line[klen] != ' ')
+			continue;
+		for (i = 0; i < ARRAY_SIZE(xcp_strategies); ++i)
+			if (strcmp(&line[klen+1], xcp_strategies[i].name) == 0)
+				ret = &xcp_strategies[i];
+	}
+	HXmc_free(line);
+	fclose(fp);
+	return ret;
+}
+
+static void xcp_cache_store(const char *key, const char *name)
+{
+	hxmc_t *path = xcp_cache_path(), *tmp, *line = NULL;
+	size_t klen = strlen(key);
+	FILE *in, *out;
+	char *dir;
+	int fd;
+
+	if (path == NULL)
+		return;
+	dir = HX_dirname(path);
+	if (dir == NULL || HX_mkdir(dir, S_IRWXU) < 0) {
+		free(dir);
+		HXmc_free(path);
+		return;
+	}
+	free(dir);
+	tmp = HXmc_strinit(path);
+	HXmc_strcat(&tmp, ".XXXXXX");
+	fd = mkstemp(tmp);
+	out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (out == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		goto out;
+	}
+	in = fopen(path, "r");
+	if (in != NULL) {
+		while (HX_getl(&line, in) != NULL)
+			if (strncmp(line, key, klen) != 0 || line[klen] != ' ')
+				fputs(line, out);
+		HXmc_free(line);
+		fclose(in);
+	}
+	fprintf(out, "%s %s\n", key, name);
+	if (fclose(out) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+ out:
+	HXmc_free(tmp);
+	HXmc_free(path);
+}
+
+/**
+ * Get the source out of the page cache, so that each strategy starts cold.
+ * Only root can drop all caches; everyone else can still ask the kernel to
+ * drop the pages of the file.
+ */
+static const char *xcp_drop_caches(const char *input)
+{
+	int fd;
+
+	if (geteuid() == 0) {
+		sync();
+		fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+		if (fd >= 0 && write(fd, "3", 1) == 1) {
+			close(fd);
+			return "drop_caches";
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+	fd = open(input, O_RDONLY);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
 	}
-	madvise(area, isb.st_size, MADV_SEQUENTIAL);
+	return "fadvise";
+}
+
+/**
+ * Copy @input to @output with every strategy in turn, starting with a cold
+ * cache, and stopping the clock only when the copy has reached the disk.
+ * The fastest strategy is remembered for --auto.
+ */
+static int xcp_benchmark(const char *input, const char *output)
+{
+	const struct xcp_strategy *best = NULL;
+	struct timespec t_start, t_stop;
+	struct rusage r_start, r_stop;
+	const char *how = NULL;
+	double secs, mbps, best_mbps = 0;
+	struct stat sb;
+	char key[64];
+	size_t i;
+	int fd;
 
-	if (write(ofd, area, isb.st_size) != isb.st_size) {
-		perror("write");
+	if (stat(input, &sb) < 0) {
+		fprintf(stderr, "stat(\"%s\"): %s\n", input, strerror(errno));
 		return EXIT_FAILURE;
 	}
+	printf("%-10s %9s %8s %8s %8s %9s\n", "strategy", "MB/s", "wall/s",
+	       "user/s", "sys/s", "I/O calls");
+	for (i = 0; i < ARRAY_SIZE(xcp_strategies); ++i) {
+		const struct xcp_strategy *st = &xcp_strategies[i];
+
+		unlink(output);
+		how = xcp_drop_caches(input);
+		xcp_mode = st->mode;
+		xcp_calls = 0;
+		xcp_fellback = false;
+		getrusage(RUSAGE_SELF, &r_start);
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+		if (xcp_copy(input, output) != EXIT_SUCCESS) {
+			printf("%-10s (failed)\n", st->name);
+			continue;
+		}
+		fd = open(output, O_WRONLY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t_stop);
+		getrusage(RUSAGE_SELF, &r_stop);
+		secs = t_stop.tv_sec - t_start.tv_sec +
+		       (t_stop.tv_nsec - t_start.tv_nsec) / 1e9;
+		mbps = secs > 0 ? sb.st_size / secs / 1e6 : 0;
+		printf("%-10s %9.1f %8.3f %8.3f %8.3f %9lu%s\n", st->name,
+		       mbps, secs,
+		       r_stop.ru_utime.tv_sec - r_start.ru_utime.tv_sec +
+		       (r_stop.ru_utime.tv_usec - r_start.ru_utime.tv_usec) / 1e6,
+		       r_stop.ru_stime.tv_sec - r_start.ru_stime.tv_sec +
+		       (r_stop.ru_stime.tv_usec - r_start.ru_stime.tv_usec) / 1e6,
+		       xcp_calls, xcp_fellback ? " (fell back)" : "");
+		if (!xcp_fellback && (best == NULL || mbps > best_mbps)) {
+			best = st;
+			best_mbps = mbps;
+		}
+	}
+	printf("Caches dropped with %s.\n", how != NULL ? how : "-");
+	if (best != NULL && xcp_fs_pair(input, output, key, sizeof(key))) {
+		xcp_cache_store(key, best->name);
+		printf("Fastest: %s, used by --auto for this filesystem pair.\n",
+		       best->name);
+	}
+	unlink(output);
+	return best != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static char *xcp_join(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	char *path = malloc(dlen + nlen + 2);
+
+	if (path == NULL)
+		return NULL;
+	if (dlen == 0) {
+		memcpy(path, name, nlen + 1);
+	} else {
+		memcpy(path, dir, dlen);
+		path[dlen] = '/';
+		memcpy(&path[dlen+1], name, nlen + 1);
+	}
+	return path;
+}
+
+static void xcp_tree_error(struct xcp_tree *t, const char *what,
+    const char *path)
+{
+	fprintf(stderr, "%s(\"%s\"): %s\n", what, path, strerror(errno));
+	__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Give the copy the owner, mode and timestamps of the original, through
+ * @fd if there is one, else by @path below the destination root. A failed
+ * chown is only an error for root, like in cp -a.
+ */
+static void xcp_tree_meta(struct xcp_tree *t, int fd, const char *path,
+    const struct stat *sb)
+{
+	const struct timespec ts[2] = {sb->st_atim, sb->st_mtim};
+	struct stat osb;
+	int ret;
+
+	/*
+	 * A new file can still have another group (setgid directory), and
+	 * one that is overwritten keeps its old owner, so look first.
+	 */
+	if (fd >= 0 && fstat(fd, &osb) == 0 && osb.st_uid == sb->st_uid &&
+	    osb.st_gid == sb->st_gid)
+		ret = 0;
+	else if (fd >= 0)
+		ret = fchown(fd, sb->st_uid, sb->st_gid);
+	else
+		ret = fchownat(t->droot, path, sb->st_uid, sb->st_gid,
+		      AT_SYMLINK_NOFOLLOW);
+	if (ret < 0 && (errno != EPERM || geteuid() == 0))
+		xcp_tree_error(t, "chown", path);
+	if (!S_ISLNK(sb->st_mode)) {
+		ret = fd >= 0 ? fchmod(fd, sb->st_mode & 07777) :
+		      fchmodat(t->droot, path, sb->st_mode & 07777, 0);
+		if (ret < 0)
+			xcp_tree_error(t, "chmod", path);
+	}
+	ret = fd >= 0 ? futimens(fd, ts) :
+	      utimensat(t->droot, path, ts, AT_SYMLINK_NOFOLLOW);
+	if (ret < 0)
+		xcp_tree_error(t, "utimensat", path);
+}
+
+/* Copy the data extents within @off..@end, falling back to mmap. */
+static bool xcp_tree_range(struct xcp_tree *t, int ifd, int ofd, off_t off,
+    off_t end)
+{
+	off_t start = off;
+	int ret;
+
+	while (xcp_next_data(ifd, end, &start, &off)) {
+		ret = t->copy(ifd, ofd, start, off - start);
+		if (ret == 0)
+			ret = xcp_mmap(ifd, ofd, start, off - start);
+		if (ret < 0)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * For small files, setting up a mapping or a pipe, and looking for holes,
+ * costs more than the copy; plain read and write is faster.
+ */
+static int xcp_tree_small(int ifd, int ofd, off_t size)
+{
+	char buf[XCP_SMALL_FILE];
+	ssize_t ret;
+	off_t done;
+
+	for (done = 0; done < size; done += ret) {
+		ret = read(ifd, buf + done, size - done);
+		if (ret < 0) {
+			perror("read");
+			return -1;
+		} else if (ret == 0) {
+			/* Source got shorter. */
+			size = done;
+			break;
+		}
+	}
+	for (done = 0; done < size; done += ret) {
+		ret = write(ofd, buf + done, size - done);
+		if (ret < 0) {
+			perror("write");
+			return -1;
+		}
+	}
+	return 1;
+}
 
-	munmap(area, isb.st_size);
+static void xcp_tree_file(struct xcp_tree *t, struct xcp_item *it)
+{
+	int ifd, ofd, ret;
+
+	ifd = openat(t->sroot, it->path, O_RDONLY | O_NOFOLLOW);
+	if (ifd < 0) {
+		xcp_tree_error(t, "open", it->path);
+		return;
+	}
+	ofd = openat(t->droot, it->path, O_RDWR | O_CREAT | O_TRUNC |
+	      O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (ofd < 0) {
+		xcp_tree_error(t, "open", it->path);
+		close(ifd);
+		return;
+	}
+	ret = xcp_mode == XCP_REFLINK ? xcp_reflink(ifd, ofd) : 0;
+	if (ret == 0 && it->sb.st_size <= XCP_SMALL_FILE)
+		ret = xcp_tree_small(ifd, ofd, it->sb.st_size);
+	if (ret == 0 && ftruncate(ofd, it->sb.st_size) < 0) {
+		xcp_tree_error(t, "ftruncate", it->path);
+		ret = -1;
+	} else if (ret == 0 &&
+	    !xcp_tree_range(t, ifd, ofd, 0, it->sb.st_size)) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Copying \"%s\" failed\n", it->path);
+		__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+	} else {
+		xcp_tree_meta(t, ofd, it->path, &it->sb);
+	}
 	close(ifd);
 	close(ofd);
-	return EXIT_SUCCESS;
 }
 
-static int xcp_mmap2(const char *input, const char *output)
+static void xcp_tree_chunk(struct xcp_tree *t, struct xcp_item *it,
+    off_t off, off_t len)
 {
-	struct stat isb;
+	int ifd, ofd;
 
-	int ifd = open(input, O_RDONLY);
-	if (ifd < 0) {
+	ifd = openat(t->sroot, it->path, O_RDONLY | O_NOFOLLOW);
+	ofd = openat(t->droot, it->path, O_RDWR | O_NOFOLLOW);
+	if (ifd < 0 || ofd < 0) {
+		xcp_tree_error(t, "open", it->path);
+	} else if (!xcp_tree_range(t, ifd, ofd, off, off + len)) {
+		fprintf(stderr, "Copying \"%s\" failed\n", it->path);
+		__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+	}
+	if (ifd >= 0)
+		close(ifd);
+	if (ofd >= 0)
+		close(ofd);
+	if (__atomic_sub_fetch(&it->chunks, 1, __ATOMIC_ACQ_REL) == 0) {
+		xcp_tree_meta(t, -1, it->path, &it->sb);
+		free(it->path);
+		free(it);
+	}
+}
+
+static void *xcp_tree_worker(void *arg)
+{
+	struct xcp_tree *t = arg;
+	struct xcp_task *task;
+	unsigned int i;
+
+	while (true) {
+		pthread_mutex_lock(&t->lock);
+		while (t->head == NULL && !t->done)
+			pthread_cond_wait(&t->cond, &t->lock);
+		task = t->head;
+		if (task != NULL) {
+			t->head = task->next;
+			if (t->head == NULL)
+				t->tail = NULL;
+		}
+		pthread_mutex_unlock(&t->lock);
+		if (task == NULL)
+			break;
+		if (task->len > 0) {
+			xcp_tree_chunk(t, task->item[0], task->off, task->len);
+		} else {
+			for (i = 0; i < task->nitems; ++i) {
+				xcp_tree_file(t, task->item[i]);
+				free(task->item[i]->path);
+				free(task->item[i]);
+			}
+		}
+		free(task);
+	}
+	return NULL;
+}
+
+static void xcp_tree_push(struct xcp_tree *t, struct xcp_task *task)
+{
+	pthread_mutex_lock(&t->lock);
+	if (t->tail != NULL)
+		t->tail->next = task;
+	else
+		t->head = task;
+	t->tail = task;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ * Hand a regular file to the workers. Small files are collected into
+ * batches, which saves on queue traffic when there are millions of them.
+ * Large ones are created and sized here, and queued as chunks.
+ */
+static void xcp_tree_add(struct xcp_tree *t, char *path,
+    const struct stat *sb)
+{
+	struct xcp_item *it = malloc(sizeof(*it));
+	struct xcp_task *task, *list = NULL, **lp = &list;
+	off_t off, next;
+	int fd;
+
+	if (it == NULL) {
+		perror("malloc");
+		__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+		free(path);
+		return;
+	}
+	it->path = path;
+	it->sb = *sb;
+	++t->files;
+	t->bytes += sb->st_size;
+	if (sb->st_size <= XCP_CHUNK_SIZE) {
+		if (t->batch == NULL) {
+			t->batch = calloc(1, sizeof(*t->batch));
+			if (t->batch == NULL) {
+				perror("malloc");
+				__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+				free(path);
+				free(it);
+				return;
+			}
+		}
+		task = t->batch;
+		task->item[task->nitems++] = it;
+		task->bytes += sb->st_size;
+		if (task->nitems == XCP_BATCH_FILES ||
+		    task->bytes >= XCP_BATCH_BYTES) {
+			xcp_tree_push(t, task);
+			t->batch = NULL;
+		}
+		return;
+	}
+
+	fd = openat(t->droot, path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+	     S_IRUSR | S_IWUSR);
+	if (fd < 0 || ftruncate(fd, sb->st_size) < 0) {
+		xcp_tree_error(t, "open", path);
+		if (fd >= 0)
+			close(fd);
+		free(path);
+		free(it);
+		return;
+	}
+	close(fd);
+	it->chunks = (sb->st_size + XCP_CHUNK_SIZE - 1) / XCP_CHUNK_SIZE;
+	/* Allocate all chunks first, the workers may free @it at any time. */
+	for (off = 0; off < sb->st_size; off = next) {
+		next = off + XCP_CHUNK_SIZE < sb->st_size ?
+		       off + XCP_CHUNK_SIZE : sb->st_size;
+		task = calloc(1, sizeof(*task));
+		if (task == NULL) {
+			perror("malloc");
+			__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+			for (; list != NULL; list = task) {
+				task = list->next;
+				free(list);
+			}
+			free(path);
+			free(it);
+			return;
+		}
+		task->item[0] = it;
+		task->nitems = 1;
+		task->off = off;
+		task->len = next - off;
+		*lp = task;
+		lp = &task->next;
+	}
+	for (; list != NULL; list = task) {
+		task = list->next;
+		list->next = NULL;
+		xcp_tree_push(t, list);
+	}
+}
+
+/* Recreate a symlink, device, FIFO or socket. */
+static void xcp_tree_special(struct xcp_tree *t, int sfd, const char *name,
+    const char *path, const struct stat *sb)
+{
+	char *target = NULL;
+	ssize_t ret;
+
+	if (S_ISLNK(sb->st_mode)) {
+		target = malloc(sb->st_size + 1);
+		ret = target == NULL ? -1 :
+		      readlinkat(sfd, name, target, sb->st_size + 1);
+		if (ret < 0 || ret > sb->st_size) {
+			xcp_tree_error(t, "readlink", path);
+			free(target);
+			return;
+		}
+		target[ret] = '\0';
+	}
+	/* Replace what an earlier run left there. */
+	ret = target != NULL ? symlinkat(target, t->droot, path) :
+	      mknodat(t->droot, path, sb->st_mode, sb->st_rdev);
+	if (ret < 0 && errno == EEXIST && unlinkat(t->droot, path, 0) == 0)
+		ret = target != NULL ? symlinkat(target, t->droot, path) :
+		      mknodat(t->droot, path, sb->st_mode, sb->st_rdev);
+	free(target);
+	if (ret < 0)
+		xcp_tree_error(t, S_ISLNK(sb->st_mode) ? "symlink" : "mknod",
+		               path);
+	else
+		xcp_tree_meta(t, -1, path, sb);
+}
+
+/**
+ * Walk the directory @sfd (at @rel below the source root) with relative
+ * lookups, create the directories in the destination as they are found,
+ * and queue the files.
+ */
+static void xcp_tree_walk(struct xcp_tree *t, int sfd, const char *rel)
+{
+	const struct dirent *de;
+	struct xcp_item *dir;
+	struct stat sb;
+	char *path;
+	DIR *dh;
+	int fd;
+
+	fd = dup(sfd);
+	dh = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dh == NULL) {
+		xcp_tree_error(t, "opendir", rel);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	while ((de = readdir(dh)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		path = xcp_join(rel, de->d_name);
+		if (path == NULL) {
+			perror("malloc");
+			__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		if (fstatat(sfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+			xcp_tree_error(t, "stat", path);
+			free(path);
+			continue;
+		}
+		if (S_ISREG(sb.st_mode)) {
+			xcp_tree_add(t, path, &sb);
+			continue;
+		} else if (!S_ISDIR(sb.st_mode)) {
+			xcp_tree_special(t, sfd, de->d_name, path, &sb);
+			free(path);
+			continue;
+		}
+		if (mkdirat(t->droot, path, S_IRWXU) < 0 && errno != EEXIST) {
+			xcp_tree_error(t, "mkdir", path);
+			free(path);
+			continue;
+		}
+		if ((t->ndirs & (t->ndirs - 1)) == 0) {
+			dir = realloc(t->dirs, sizeof(*dir) * (t->ndirs * 2 + 1));
+			if (dir == NULL) {
+				perror("realloc");
+				__atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+				free(path);
+				break;
+			}
+			t->dirs = dir;
+		}
+		dir = &t->dirs[t->ndirs++];
+		dir->path = path;
+		dir->sb = sb;
+		fd = openat(sfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0) {
+			xcp_tree_error(t, "open", path);
+			continue;
+		}
+		xcp_tree_walk(t, fd, path);
+		close(fd);
+	}
+	closedir(dh);
+}
+
+/**
+ * Copy the tree @input to @output with xcp_jobs workers (default: one per
+ * CPU). The directory metadata is applied last, deepest first, since
+ * creating the entries changes the directory timestamps.
+ */
+/**
+ * Tell whether @output (or, if it does not exist yet, its parent) is the
+ * directory @src or lies below it, by following ".." up to the root.
+ */
+static bool xcp_tree_inside(const char *output, const struct stat *src)
+{
+	struct stat sb, up;
+	char *dir = NULL;
+	int fd, nfd;
+
+	fd = open(output, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		dir = HX_dirname(output);
+		if (dir == NULL)
+			return false;
+		fd = open(dir, O_RDONLY | O_DIRECTORY);
+		free(dir);
+	}
+	while (fd >= 0 && fstat(fd, &sb) == 0) {
+		if (sb.st_dev == src->st_dev && sb.st_ino == src->st_ino) {
+			close(fd);
+			return true;
+		}
+		nfd = openat(fd, "..", O_RDONLY | O_DIRECTORY);
+		close(fd);
+		fd = nfd;
+		if (fd >= 0 && fstat(fd, &up) == 0 &&
+		    up.st_dev == sb.st_dev && up.st_ino == sb.st_ino)
+			/* "/" is its own parent. */
+			break;
+	}
+	if (fd >= 0)
+		close(fd);
+	return false;
+}
+
+static int xcp_tree(const char *input, const char *output)
+{
+	struct xcp_tree t = {.copy = xcp_select(), .sroot = -1, .droot = -1};
+	unsigned int nthr = xcp_jobs, i;
+	struct timespec t_start, t_stop;
+	struct stat sb;
+	pthread_t *thr;
+	double secs;
+	int ret;
+
+	if (nthr == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthr = n > 0 ? n : 1;
+	}
+	t.sroot = open(input, O_RDONLY | O_DIRECTORY);
+	if (t.sroot < 0 || fstat(t.sroot, &sb) < 0) {
 		fprintf(stderr, "open(\"%s\"): %s\n", input, strerror(errno));
 		return EXIT_FAILURE;
 	}
-
-	int ofd = open(output, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (ofd < 0) {
-		fprintf(stderr, "open(\"%s\"): %s\n", output, strerror(errno));
+	if (xcp_tree_inside(output, &sb)) {
+		fprintf(stderr, "Cannot copy directory \"%s\" into itself, "
+		        "\"%s\"\n", input, output);
+		close(t.sroot);
 		return EXIT_FAILURE;
 	}
-
-	if (fstat(ifd, &isb) < 0) {
-		perror("fstat");
+	if (mkdir(output, S_IRWXU) < 0 && errno != EEXIST) {
+		fprintf(stderr, "mkdir(\"%s\"): %s\n", output, strerror(errno));
+		close(t.sroot);
 		return EXIT_FAILURE;
 	}
-	if (ftruncate(ofd, isb.st_size) != 0) {
-		perror("ftruncate");
+	t.droot = open(output, O_RDONLY | O_DIRECTORY);
+	thr = calloc(nthr, sizeof(*thr));
+	if (t.droot < 0 || thr == NULL) {
+		fprintf(stderr, "open(\"%s\"): %s\n", output, strerror(errno));
+		close(t.sroot);
+		if (t.droot >= 0)
+			close(t.droot);
+		free(thr);
 		return EXIT_FAILURE;
 	}
+	pthread_mutex_init(&t.lock, NULL);
+	pthread_cond_init(&t.cond, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for (i = 0; i < nthr; ++i) {
+		ret = pthread_create(&thr[i], NULL, xcp_tree_worker, &t);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			break;
+		}
+	}
+	nthr = i;
+	xcp_tree_walk(&t, t.sroot, "");
+	pthread_mutex_lock(&t.lock);
+	if (t.batch != NULL) {
+		if (t.tail != NULL)
+			t.tail->next = t.batch;
+		else
+			t.head = t.batch;
+		t.tail = t.batch;
+	}
+	t.done = true;
+	pthread_cond_broadcast(&t.cond);
+	pthread_mutex_unlock(&t.lock);
+	if (nthr == 0)
+		/* No threads at all, work through the queue here. */
+		xcp_tree_worker(&t);
+	for (i = 0; i < nthr; ++i)
+		pthread_join(thr[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t_stop);
 
-	void *iarea = mmap(NULL, isb.st_size, PROT_READ, MAP_SHARED, ifd, 0);
-	if (iarea == (void *)-1) {
-		perror("mmap");
-		return EXIT_FAILURE;
+	while (t.ndirs-- > 0) {
+		xcp_tree_meta(&t, -1, t.dirs[t.ndirs].path, &t.dirs[t.ndirs].sb);
+		free(t.dirs[t.ndirs].path);
 	}
-	void *oarea = mmap(NULL, isb.st_size, PROT_WRITE, MAP_PRIVATE, ofd, 0);
-	if (oarea == (void *)-1) {
-		perror("mmap - 2");
+	xcp_tree_meta(&t, t.droot, output, &sb);
+	secs = t_stop.tv_sec - t_start.tv_sec +
+	       (t_stop.tv_nsec - t_start.tv_nsec) / 1e9;
+	printf("%llu files, %llu bytes in %.3f s (%.1f MB/s) with %u threads\n",
+	       t.files, t.bytes, secs, secs > 0 ? t.bytes / secs / 1e6 : 0,
+	       nthr);
+	pthread_cond_destroy(&t.cond);
+	pthread_mutex_destroy(&t.lock);
+	free(t.dirs);
+	free(thr);
+	close(t.sroot);
+	close(t.droot);
+	return t.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Write @input to stdout, e.g. into a pipe or a socket. This is a stream,
+ * so holes are sent as zeros. splice(2) does it without copying; when
+ * stdout does not support it (a terminal, a file opened with O_APPEND),
+ * read and write are used.
+ */
+static int xcp_stream(const char *input)
+{
+	char buf[65536];
+	ssize_t in, out, done;
+	struct stat sb;
+	int fd, ret;
+
+	fd = open(input, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		fprintf(stderr, "open(\"%s\"): %s\n", input, strerror(errno));
+		if (fd >= 0)
+			close(fd);
 		return EXIT_FAILURE;
 	}
-	close(ifd);
-	close(ofd);
-	madvise(iarea, isb.st_size, MADV_SEQUENTIAL);
-	madvise(oarea, isb.st_size, MADV_SEQUENTIAL);
-	printf("Copying...\n");
-	memcpy(oarea, iarea, isb.st_size);
-	printf("Unmap...\n");
-	munmap(iarea, isb.st_size);
-	munmap(oarea, isb.st_size);
-	return EXIT_SUCCESS;
+	ret = xcp_splice_to(fd, 0, sb.st_size, STDOUT_FILENO, NULL);
+	while (ret == 0) {
+		in = read(fd, buf, sizeof(buf));
+		if (in < 0) {
+			perror("read");
+			ret = -1;
+		} else if (in == 0) {
+			ret = 1;
+		}
+		for (done = 0; done < in; done += out) {
+			out = write(STDOUT_FILENO, buf + done, in - done);
+			if (out < 0) {
+				perror("write");
+				ret = -1;
+				break;
+			}
+		}
+	}
+	close(fd);
+	return ret > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 static int main2(int argc, const char **argv)
 {
+	const struct xcp_strategy *st = NULL;
+	char key[64];
+	FILE *fp;
+
 	if (!xcp_get_options(&argc, &argv))
 		return EXIT_FAILURE;
 	if (argc != 3) {
@@ -198,14 +2078,41 @@ static int main2(int argc, const char **argv)
 		        *argv);
 		return EXIT_FAILURE;
 	}
-
-	if (xcp_mode == XCP_SPLICE)
-		return xcp_splice(argv[1], argv[2]);
-	else if (xcp_mode == XCP_MMAP)
-		return xcp_mmap(argv[1], argv[2]);
-	else if (xcp_mode == XCP_MMAP2)
-		return xcp_mmap2(argv[1], argv[2]);
-	return EXIT_FAILURE;
+	if (xcp_recursive && (xcp_verify || xcp_bench)) {
+		fprintf(stderr, "%s: -r cannot be combined with -V or --bench\n",
+		        *argv);
+		return EXIT_FAILURE;
+	}
+	fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld", &xcp_pipe_max) != 1)
+			xcp_pipe_max = 1 << 20;
+		fclose(fp);
+	}
+	if (strcmp(argv[2], "-") == 0) {
+		if (xcp_recursive || xcp_verify || xcp_bench) {
+			fprintf(stderr, "%s: -r, -V and --bench need a "
+			        "destination file\n", *argv);
+			return EXIT_FAILURE;
+		}
+		return xcp_stream(argv[1]);
+	}
+	if (xcp_verify)
+		xcp_crc_init();
+	if (xcp_bench)
+		return xcp_benchmark(argv[1], argv[2]);
+	if (xcp_auto) {
+		if (xcp_fs_pair(argv[1], argv[2], key, sizeof(key)))
+			st = xcp_cache_lookup(key);
+		if (st != NULL)
+			xcp_mode = st->mode;
+		else
+			fprintf(stderr, "%s: no --bench results for these "
+			        "filesystems, using mmap\n", *argv);
+	}
+	if (xcp_recursive)
+		return xcp_tree(argv[1], argv[2]);
+	return xcp_copy(argv[1], argv[2]);
 }
 
 int main(int argc, const char **argv)